@@ -2,14 +2,30 @@
  * buddy_alloc.c: Simple buddy allocator.
  *
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
 
 #include "list.h"
 
@@ -18,39 +34,752 @@
 #define msg_info(msg, ...)						\
 	printf("[INFO]: " msg "\n", ##__VA_ARGS__)
 
+/* orders 0..BUDDY_CACHE_ORDERS - 1 can be served from per-thread magazines */
+#define BUDDY_CACHE_ORDERS	4
+#define BUDDY_CACHE_DEPTH_MAX	64
+
 struct prog_args_t {
 	bool help;
 	bool is_verbose;
 	int max_order;
 	int page_size;
-	int start_addr;
-	int alloc_size;
+	uint64_t start_addr;
+	uint64_t alloc_size;
 	int alloc_loop;
 	int sub_loop;
+	int backend;
+	int cache_depth[BUDDY_CACHE_ORDERS];
+	int threads;
+	int lockfree_orders;
+	int nr_nodes;
+	int spill;
+	int memory;
+	int bulk;
+	int lazy_watermark;
+	bool track_used;
+	/* bit n set to run benchmark workload n */
+	int bench;
+	const char *record;
+	const char *replay;
+	bool frag;
+	bool free_map;
+	uint64_t align;
+	bool exact;
+	int policy;
+	const char *snapshot;
+	const char *restore;
+	const char *shm;
+	bool async_free;
+	int reserve_blocks;
+	uint64_t reserve_orders;
+	int hot_order;
+	int hot_reserve;
+	bool compare;
+	uint64_t low_watermark;
+	uint64_t high_watermark;
 };
 
+/*
+ * Entries refer to each other by 32 bit index: into the entry pool for
+ * the list backend, into the frame table for the bitmap backend.
+ */
+#define BUDDY_NIL		UINT32_MAX
+
 struct buddy_entry_t {
-	unsigned int start_addr;
-	int order;
-	bool is_used;
-	struct buddy_entry_t *buddy;
-	struct buddy_entry_t *parent;
+	/* hot: touched by every alloc and free */
 	struct list_head_t link;
+	uint64_t start_addr;
+	int8_t order;
+	bool is_used;
+	uint32_t buddy;
+	uint32_t index;
+	/* next block while parked on a lock-free stack */
+	uint32_t stack_next;
+	/* cold: only followed when a pair merges */
+	uint32_t parent;
+};
+
+/*
+ * The pool table holds a fully split tree, so an entry's index is simply
+ * its slot. Past BUDDY_POOL_MAX_ORDER the table outgrows what is sane to
+ * reserve, even untouched.
+ */
+#define BUDDY_POOL_MAX_ORDER	27
+/* order of an entry sitting on the pool freelist */
+#define BUDDY_POOL_FREE		-1
+/* per-order spare entries, moved to and from the pool in batches */
+#define BUDDY_SPARE_BATCH	16
+#define BUDDY_SPARE_MAX		64
+
+struct buddy_entry_pool_t {
+	int total_count;
+	int used_count;
+	int high_water;
+	/* slots from here on were never handed out and are still untouched */
+	int fresh;
+	struct list_head_t free_entries;
+	struct buddy_entry_t *entries;
+	pthread_mutex_t lock;
 };
 
+/*
+ * Each order is protected by its own lock. A path that needs several
+ * orders always takes them from low to high: splitting holds every order
+ * between the request and the block it splits, coalescing hands over from
+ * one order to the next.
+ */
 struct buddy_list_t {
+	/* first cache line: everything the alloc/free fast path touches */
+	pthread_mutex_t lock;
+	/* allocated blocks plus split parents, in both backends */
 	int used_count;
 	int free_count;
-	struct list_head_t used_entries;
 	struct list_head_t free_entries;
+	/* buddy pairs of this order created by a split / merged back */
+	unsigned long splits;
+	unsigned long merges;
+	struct list_head_t used_entries;
+	/* list backend: entries for the next split into this order */
+	struct list_head_t spare_entries;
+	int spare_count;
+} __attribute__((aligned(64)));
+
+#define BUDDY_SIZE_CLASS_PAGES	64
+
+/*
+ * A magazine is a small LIFO of blocks that are allocated as far as the
+ * shared buddy lists are concerned, but owned by one thread. It refills
+ * from and flushes to the shared lists half a depth at a time.
+ */
+struct buddy_magazine_t {
+	int count;
+	int depth;
+	struct buddy_entry_t *slots[BUDDY_CACHE_DEPTH_MAX];
+	unsigned long alloc_hits;
+	unsigned long alloc_misses;
+	unsigned long free_hits;
+	unsigned long free_misses;
+};
+
+/*
+ * Treiber stack of blocks for one low order. The head packs a 32 bit
+ * ABA tag above a 32 bit entry index, so push and pop are a single
+ * 64 bit CAS. Parked blocks still count as used on the buddy lists.
+ */
+#define BUDDY_LF_ORDERS_MAX	8
+#define BUDDY_LF_DEPTH		256
+
+struct buddy_lf_stack_t {
+	uint64_t head;	/* tag << 32 | entry index */
+	int count;
+	unsigned long pop_hits;
+	unsigned long pop_misses;
+	unsigned long push_hits;
+	unsigned long push_overflows;
+} __attribute__((aligned(64)));
+
+/*
+ * Hot order fast path: a Treiber stack of pre-split blocks of one order,
+ * refilled half a reserve at a time. Requests in [min_size, max_size]
+ * map to the hot order without a size-to-order lookup.
+ */
+#define BUDDY_HOT_DEPTH		64
+#define BUDDY_HOT_DEPTH_MAX	256
+
+struct buddy_hot_t {
+	struct buddy_lf_stack_t stack;
+	uint64_t min_size;
+	uint64_t max_size;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long refills;
+	unsigned long refill_blocks;
+};
+
+/*
+ * Background coalescer. Freeing threads push onto an intrusive MPSC
+ * stack through entry->stack_next; a consumer takes the whole chain with
+ * one exchange. Push-only CAS followed by take-all cannot suffer ABA,
+ * so the head is a bare index. consume_lock keeps a single consumer, so
+ * a synchronous flush also waits out the batch the worker has in hand.
+ */
+struct buddy_coalescer_t {
+	uint32_t head;
+	bool refill;	/* an allocation took from a reserve order */
+	bool sleeping;
+	bool stop;
+	pthread_t thread;
+	pthread_mutex_t consume_lock;
+	pthread_mutex_t wait_lock;
+	pthread_cond_t wake;
+	unsigned long deferred;
+	unsigned long batches;
+	unsigned long wakeups;
+	unsigned long refills;
+};
+
+/*
+ * Shrinkers hand memory back when an allocation finds the lists empty.
+ * They run in ascending cost, and the allocation is retried after each
+ * one that released something. shrink() returns the number of blocks or
+ * merges it gave back. Those below BUDDY_SHRINK_COST_AHEAD also run when
+ * free memory drops under the low watermark, ahead of any failure.
+ */
+#define BUDDY_SHRINK_COST_COALESCER	10
+#define BUDDY_SHRINK_COST_CACHES	20
+#define BUDDY_SHRINK_COST_SLAB		30
+#define BUDDY_SHRINK_COST_COMPACT	40
+#define BUDDY_SHRINKERS_BUILTIN		4
+/* between slab and compaction: the cache and slab trims run ahead, compaction never */
+#define BUDDY_SHRINK_COST_AHEAD		35
+
+_Static_assert(BUDDY_SHRINK_COST_SLAB < BUDDY_SHRINK_COST_AHEAD &&
+		BUDDY_SHRINK_COST_AHEAD < BUDDY_SHRINK_COST_COMPACT,
+		"the watermark pass has to stop short of compaction");
+
+struct buddy_allocator_t;
+
+struct buddy_shrinker_t {
+	struct list_head_t link;
+	const char *name;
+	int cost;
+	int (*shrink)(struct buddy_allocator_t *allocator, int order, void *data);
+	void *data;
+	unsigned long calls;
+	unsigned long reclaimed;
+};
+
+/* pressure_notify() levels */
+enum buddy_pressure_t {
+	BUDDY_PRESSURE_HIGH,	/* back above the high watermark */
+	BUDDY_PRESSURE_LOW,	/* dropped below the low watermark */
+};
+
+/*
+ * Binary allocation trace: a header followed by fixed size records, in
+ * host byte order so a replay can walk the mmap'd file in place. Handle
+ * ids are only unique among live blocks; an id is reused after its free.
+ */
+#define BUDDY_TRACE_MAGIC	"BUDDYTRC"
+#define BUDDY_TRACE_VERSION	1
+
+enum buddy_trace_op_t {
+	BUDDY_TRACE_ALLOC,
+	BUDDY_TRACE_FREE,
+};
+
+struct buddy_trace_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t nr_records;
+	/* every handle id is below nr_handles */
+	uint32_t nr_handles;
+	uint32_t pad;
+};
+
+/*
+ * Snapshot image: the header, then for every order from 0 to max_order
+ * a bitmap with one bit per block of that order, set when the block was
+ * allocated, in 64 bit words. Blocks are named by their page offset, so
+ * the image holds no addresses and can be restored at another
+ * start_addr or mapping. Free space is implied by whatever is not
+ * allocated.
+ */
+#define BUDDY_SNAPSHOT_MAGIC	"BUDDYSNP"
+#define BUDDY_SNAPSHOT_VERSION	1
+#define BUDDY_SNAPSHOT_MAX_ORDER	32
+
+struct buddy_snapshot_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t max_order;
+	uint32_t pad;
+	uint64_t nr_blocks;
+	/* informational, restore may use another one */
+	uint64_t start_addr;
+};
+
+/*
+ * Shared memory mode: one segment from shm_open() holds the header, a
+ * frame per page, the pair bitmaps and the pages themselves, so every
+ * process that maps it allocates from the same pool. It runs the bitmap
+ * backend algorithm with the free lists threaded through the frames by
+ * page index instead of list_head_t pointers, and nothing in the
+ * segment depends on where it is mapped. A single process-shared robust
+ * mutex guards it; if its owner dies the next locker rebuilds the free
+ * lists from the allocated blocks, which a crash cannot leave half
+ * recorded.
+ */
+#define BUDDY_SHM_MAGIC		"BUDDYSHM"
+#define BUDDY_SHM_VERSION	1
+#define BUDDY_SHM_MAX_ORDER	26
+#define BUDDY_SHM_NONE		UINT64_MAX
+
+struct buddy_shm_frame_t {
+	uint32_t next;
+	uint32_t prev;
+	int8_t order;
+	bool is_used;
+};
+
+struct buddy_shm_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t max_order;
+	uint32_t pad;
+	uint64_t segment_size;
+	/* byte offsets from the start of the segment */
+	uint64_t frames_offset;
+	uint64_t pair_offset;
+	uint64_t data_offset;
+	pthread_mutex_t lock;
+	uint64_t free_area_mask;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long failures;
+	unsigned long recoveries;
+	struct {
+		uint32_t head;
+		uint32_t free_count;
+		uint32_t used_count;
+	} order[BUDDY_SHM_MAX_ORDER + 1];
+};
+
+/* one process's view of the segment */
+struct buddy_shm_t {
+	struct buddy_shm_header_t *header;
+	struct buddy_shm_frame_t *frames;
+	uint64_t *pair_map;
+	char *data;
+	int shift;
+};
+
+struct buddy_trace_record_t {
+	uint64_t timestamp;	/* ns since the trace was opened */
+	uint64_t size;		/* requested bytes, 0 for a free */
+	uint32_t handle;
+	uint8_t op;
+	uint8_t pad[3];
+};
+
+struct buddy_trace_t {
+	FILE *file;
+	pthread_mutex_t lock;
+	uint64_t start;
+	uint64_t nr_records;
+	uint32_t nr_handles;
+};
+
+/* free_area_mask has one bit per order */
+#define BUDDY_MAX_ORDER		63
+
+/*
+ * Hot-path counters for one order, kept per thread when built with
+ * BUDDY_STATS and summed up by buddy_get_stats(). Splits and merges are
+ * charged to the order that was requested or freed.
+ */
+struct buddy_order_stats_t {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long failures;
+	unsigned long splits;
+	unsigned long merges;
+	unsigned long max_split_depth;
+	unsigned long max_merge_depth;
+};
+
+struct buddy_stats_t {
+	int max_order;
+	int nr_threads;
+	unsigned long long bytes_requested;
+	unsigned long long bytes_allocated;
+	unsigned long compactions;
+	struct {
+		int free_blocks;
+		int used_blocks;
+		/* buddy pairs of this order created by a split / merged back */
+		unsigned long pair_splits;
+		unsigned long pair_merges;
+		/* all zero unless built with BUDDY_STATS */
+		struct buddy_order_stats_t ops;
+	} order[BUDDY_MAX_ORDER + 1];
+};
+
+/*
+ * Free space report, derived from the per-order free counts alone. The
+ * indices are in thousandths like the kernel's extfrag_index and
+ * unusable_index: extfrag is -1000 while the order can still be served,
+ * otherwise it leans to 0 when the failure is due to lack of memory and
+ * to 1000 when it is due to fragmentation. unusable is the share of free
+ * memory that sits in blocks too small for the order.
+ */
+struct buddy_frag_t {
+	int max_order;
+	int largest_order;	/* -1 when nothing is free */
+	uint64_t free_bytes;
+	unsigned long free_blocks;
+	struct {
+		unsigned long free_blocks;
+		/* bytes in free blocks of this order or above */
+		uint64_t allocatable_bytes;
+		int extfrag;
+		int unusable;
+	} order[BUDDY_MAX_ORDER + 1];
+};
+
+struct buddy_thread_cache_t {
+	int id;
+	struct buddy_allocator_t *allocator;
+	struct buddy_magazine_t mag[BUDDY_CACHE_ORDERS];
+	struct list_head_t link;
+#ifdef BUDDY_STATS
+	struct buddy_order_stats_t stats[BUDDY_MAX_ORDER + 1];
+#endif
+};
+
+enum buddy_backend_t {
+	BUDDY_BACKEND_LIST,
+	BUDDY_BACKEND_BITMAP,
+};
+
+/* which free block of an order gets handed out next */
+enum buddy_policy_t {
+	BUDDY_POLICY_LIFO,	/* the most recently freed one */
+	BUDDY_POLICY_ADDRESS,	/* the lowest addressed one */
+};
+
+/*
+ * Address ordered policy: besides its free list, each order keeps a
+ * bitmap of its free blocks with a summary bit per word above it, one
+ * level after another up to a single word. Insertion and removal touch
+ * at most one word per level and the lowest free block is found by
+ * walking down from the top word, 4 levels for 2^24 blocks.
+ */
+#define BUDDY_ADDR_LEVELS_MAX	6
+
+struct buddy_addr_map_t {
+	int levels;
+	unsigned long *level[BUDDY_ADDR_LEVELS_MAX];
+};
+
+/*
+ * Slab layer: sub-page objects come from power of two size classes of
+ * BUDDY_SLAB_MIN_OBJECT bytes up to an eighth of a page. Every class
+ * carves blocks of slab_order into equal objects, with the header below
+ * at the start of the block and the free objects chained through their
+ * first word, so a get or put is a pop or push under the class lock.
+ * Slabs are aligned to their size, which is how a freed object finds
+ * its header. Needs backing memory.
+ */
+#define BUDDY_SLAB_MIN_SHIFT	4
+#define BUDDY_SLAB_MIN_OBJECT	(1 << BUDDY_SLAB_MIN_SHIFT)
+#define BUDDY_SLAB_ORDER	2
+
+struct buddy_slab_cache_t;
+
+struct buddy_slab_t {
+	struct list_head_t link;
+	struct buddy_slab_cache_t *cache;
+	struct buddy_entry_t *entry;
+	void *free_objects;
+	int inuse;
+};
+
+struct buddy_slab_cache_t {
+	pthread_mutex_t lock;
+	uint32_t object_size;
+	/* offset of the first object, past the header */
+	uint32_t offset;
+	int objects_per_slab;
+	/* some objects allocated / all of them / none */
+	struct list_head_t partial;
+	struct list_head_t full;
+	struct list_head_t empty;
+	int nr_slabs;
+	int nr_empty;
+	unsigned long inuse;
+};
+
+enum buddy_memory_t {
+	BUDDY_MEMORY_NONE,	/* addresses are labels only */
+	BUDDY_MEMORY_MMAP,
+	BUDDY_MEMORY_THP,	/* mmap + MADV_HUGEPAGE */
+	BUDDY_MEMORY_HUGETLB,	/* mmap with MAP_HUGETLB */
 };
 
 struct buddy_allocator_t {
 	int max_order;
 	int page_size;
 	int shift_count;
-	unsigned int start_addr;
+	uint64_t start_addr;
+	enum buddy_backend_t backend;
+	/* bit n set while buddy_list[n].free_entries is non-empty */
+	uint64_t free_area_mask;
+#ifdef BUDDY_FIXED_MAX_ORDER
+	struct buddy_list_t buddy_list[BUDDY_FIXED_MAX_ORDER + 1];
+#else
 	struct buddy_list_t *buddy_list;
+#endif
+	struct buddy_entry_pool_t entry_pool;
+	/* bitmap backend: one frame per page, one bit per buddy pair */
+	struct buddy_entry_t *frames;
+	unsigned long **pair_map;
+	/* order for requests of 1..BUDDY_SIZE_CLASS_PAGES pages */
+	unsigned char size_class[BUDDY_SIZE_CLASS_PAGES + 1];
+	unsigned long long bytes_requested;
+	unsigned long long bytes_allocated;
+	/* per-thread magazines, 0 depth disables caching for that order */
+	int cache_depth[BUDDY_CACHE_ORDERS];
+	pthread_key_t cache_key;
+	int nr_caches;
+	struct list_head_t caches;
+	/* protects the cache list */
+	pthread_mutex_t lock;
+	/* orders below lockfree_orders are fronted by a lock-free stack */
+	int lockfree_orders;
+	int lockfree_depth;
+	struct buddy_lf_stack_t lf_stack[BUDDY_LF_ORDERS_MAX];
+	/* hot_reserve > 0 fronts hot_order with buddy_hot_t */
+	int hot_order;
+	int hot_reserve;
+	struct buddy_hot_t hot;
+	/*
+	 * Backing memory: a block at start_addr + off lives at base + off.
+	 * block_map finds the list backend entry of an allocated pointer or
+	 * handle, the bitmap backend uses its frame table for that. The list
+	 * backend only keeps it with backing memory or when handles is set.
+	 */
+	enum buddy_memory_t memory;
+	void *base;
+	size_t region_size;
+	struct buddy_entry_t **block_map;
+	bool handles;
+	/*
+	 * Lazy coalescing (list backend): a freed block only merges once its
+	 * order already has lazy_watermark free blocks. The rest is merged by
+	 * buddy_compact(), also run when an allocation would otherwise fail.
+	 */
+	int lazy_watermark;
+	unsigned long compactions;
+	/*
+	 * Hold back merging at every order in the reserve_orders mask until it
+	 * has reserve_blocks free blocks (list backend), so the hot orders are
+	 * served without a split. With async_free the shared-list half of a
+	 * free is queued to a background coalescer, which also tops the
+	 * reserve back up by splitting larger blocks.
+	 */
+	bool async_free;
+	int reserve_blocks;
+	uint64_t reserve_orders;
+	struct buddy_coalescer_t *coalescer;
+	/* reclaim, in ascending cost; shrinker_lock also serialises the walk */
+	struct list_head_t shrinkers;
+	pthread_mutex_t shrinker_lock;
+	struct buddy_shrinker_t builtin_shrinkers[BUDDY_SHRINKERS_BUILTIN];
+	/*
+	 * Memory pressure, in pages on the free lists: crossing low_watermark
+	 * runs the cheap shrinkers and notifies LOW once, climbing back to
+	 * high_watermark notifies HIGH. free_pages is only kept when
+	 * low_watermark is set.
+	 */
+	uint64_t low_watermark;
+	uint64_t high_watermark;
+	uint64_t free_pages;
+	bool under_pressure;
+	unsigned long pressure_events;
+	void (*pressure_notify)(struct buddy_allocator_t *allocator,
+			enum buddy_pressure_t level, void *data);
+	void *pressure_data;
+	/*
+	 * Keep allocated blocks on buddy_list_t::used_entries. Nothing walks
+	 * that list, so by default only used_count is maintained and an
+	 * allocated entry's link is left unlinked.
+	 */
+	bool track_used;
+	/* when set, every buddy_alloc()/buddy_free() is appended to it */
+	struct buddy_trace_t *trace;
+	/* arena nodes share one trace: ids are entry index * stride + node */
+	uint32_t trace_node;
+	uint32_t trace_stride;
+	/*
+	 * The free lists stay in use for compaction and the reports under
+	 * either policy, BUDDY_POLICY_ADDRESS only changes which block is
+	 * popped. The list backend finds its free entries by first page in
+	 * free_index. Magazines and lock-free stacks stay LIFO.
+	 */
+	enum buddy_policy_t policy;
+	struct buddy_addr_map_t *addr_map;
+	uint32_t *free_index;
+	/*
+	 * Set up by buddy_allocator_init() when there is backing memory.
+	 * Empty slabs are kept for reuse until an allocation would fail, then
+	 * buddy_slab_shrink() hands them back to the buddy lists.
+	 */
+	struct buddy_slab_cache_t *slab_caches;
+	int nr_slab_classes;
+	int slab_order;
+};
+
+/*
+ * The geometry is normally taken from the allocator at run time. Building
+ * with -DBUDDY_FIXED_PAGE_SIZE=<bytes> -DBUDDY_FIXED_MAX_ORDER=<order>
+ * (see "make fixed") turns it into constants instead: the hot paths then
+ * shift and mask by immediates, buddy_list[] is embedded in the allocator
+ * and the range checks happen at compile time. buddy_allocator_init()
+ * refuses any other geometry.
+ */
+#if defined(BUDDY_FIXED_PAGE_SIZE) != defined(BUDDY_FIXED_MAX_ORDER)
+#error "BUDDY_FIXED_PAGE_SIZE and BUDDY_FIXED_MAX_ORDER go together"
+#endif
+
+#ifdef BUDDY_FIXED_MAX_ORDER
+#define BUDDY_FIXED_SHIFT	__builtin_ctz(BUDDY_FIXED_PAGE_SIZE)
+
+_Static_assert(BUDDY_FIXED_PAGE_SIZE > 0 &&
+		(BUDDY_FIXED_PAGE_SIZE & (BUDDY_FIXED_PAGE_SIZE - 1)) == 0,
+		"page size must be a power of two");
+_Static_assert(BUDDY_FIXED_MAX_ORDER >= 0 && BUDDY_FIXED_MAX_ORDER <= BUDDY_MAX_ORDER,
+		"max order out of range");
+_Static_assert(BUDDY_FIXED_MAX_ORDER + BUDDY_FIXED_SHIFT < 64,
+		"region must be addressable in 64 bits");
+
+static inline int buddy_max_order(const struct buddy_allocator_t *allocator)
+{
+	return BUDDY_FIXED_MAX_ORDER;
+}
+
+static inline int buddy_page_size(const struct buddy_allocator_t *allocator)
+{
+	return BUDDY_FIXED_PAGE_SIZE;
+}
+
+static inline int buddy_shift(const struct buddy_allocator_t *allocator)
+{
+	return BUDDY_FIXED_SHIFT;
+}
+
+static inline bool buddy_geometry_matches(const struct buddy_allocator_t *allocator)
+{
+	return allocator->page_size == BUDDY_FIXED_PAGE_SIZE &&
+		allocator->max_order == BUDDY_FIXED_MAX_ORDER;
+}
+
+static inline int buddy_list_alloc(struct buddy_allocator_t *allocator)
+{
+	memset(allocator->buddy_list, 0, sizeof(allocator->buddy_list));
+	return 0;
+}
+
+static inline void buddy_list_release(struct buddy_allocator_t *allocator)
+{
+	for (int i = 0; i <= BUDDY_FIXED_MAX_ORDER; i++) {
+		pthread_mutex_destroy(&allocator->buddy_list[i].lock);
+	}
+}
+#else
+static inline int buddy_max_order(const struct buddy_allocator_t *allocator)
+{
+	return allocator->max_order;
+}
+
+static inline int buddy_page_size(const struct buddy_allocator_t *allocator)
+{
+	return allocator->page_size;
+}
+
+static inline int buddy_shift(const struct buddy_allocator_t *allocator)
+{
+	return allocator->shift_count;
+}
+
+static inline bool buddy_geometry_matches(const struct buddy_allocator_t *allocator)
+{
+	(void)allocator;
+
+	return true;
+}
+
+static inline int buddy_list_alloc(struct buddy_allocator_t *allocator)
+{
+	size_t size = sizeof(struct buddy_list_t) * (allocator->max_order + 1);
+
+	allocator->buddy_list = (struct buddy_list_t *)aligned_alloc(64, size);
+	if (allocator->buddy_list == NULL) {
+		return -1;
+	}
+	memset(allocator->buddy_list, 0, size);
+
+	return 0;
+}
+
+static inline void buddy_list_release(struct buddy_allocator_t *allocator)
+{
+	if (allocator->buddy_list == NULL) {
+		return;
+	}
+	for (int i = 0; i <= allocator->max_order; i++) {
+		pthread_mutex_destroy(&allocator->buddy_list[i].lock);
+	}
+	free(allocator->buddy_list);
+	allocator->buddy_list = NULL;
+}
+#endif
+
+/* free blocks @order keeps before a freed block may merge upwards */
+static inline int buddy_merge_watermark(struct buddy_allocator_t *allocator, int order)
+{
+	if (allocator->reserve_blocks > allocator->lazy_watermark &&
+			(allocator->reserve_orders & (1ULL << order))) {
+		return allocator->reserve_blocks;
+	}
+
+	return allocator->lazy_watermark;
+}
+
+/* whether free lists can hold unmerged buddies that buddy_compact() joins */
+static inline bool buddy_defers_merges(struct buddy_allocator_t *allocator)
+{
+	return allocator->lazy_watermark > 0 || allocator->reserve_blocks > 0;
+}
+
+/*
+ * The bitmap backend keeps a frame per page, so its metadata is fixed
+ * but proportional to the whole region rather than to the live blocks.
+ */
+#define BUDDY_BITMAP_MAX_ORDER	24
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+/*
+ * Arena: one buddy allocator per NUMA node, laid out back to back from
+ * the template's start_addr. Allocations go to the caller's node and may
+ * spill over to other nodes, nearest first.
+ */
+#define BUDDY_ARENA_MAX_NODES	64
+
+enum buddy_spill_t {
+	BUDDY_SPILL_NEAREST,
+	BUDDY_SPILL_NONE,
+};
+
+struct buddy_node_stats_t {
+	unsigned long local_allocs;
+	unsigned long spilled_in;
+	unsigned long spilled_out;
+	unsigned long failures;
+} __attribute__((aligned(64)));
+
+struct buddy_arena_t {
+	int nr_nodes;
+	enum buddy_spill_t spill;
+	uint64_t start_addr;
+	uint64_t node_size;
+	struct buddy_allocator_t *nodes;
+	/* spill_order[n] lists the other nodes by distance from n */
+	int (*spill_order)[BUDDY_ARENA_MAX_NODES];
+	struct buddy_node_stats_t *stats;
 };
 
 static const struct option long_options[] = {
@@ -62,265 +791,5647 @@ static const struct option long_options[] = {
 	{"loop",	1, 0, 'l'},
 	{"sub-loop",	1, 0, 'n'},
 	{"alloc-size",	1, 0, 'a'},
+	{"backend",	1, 0, 'b'},
+	{"cache-depth",	1, 0, 'c'},
+	{"threads",	1, 0, 't'},
+	{"lockfree",	1, 0, 'f'},
+	{"nodes",	1, 0, 'N'},
+	{"spill",	1, 0, 'S'},
+	{"memory",	1, 0, 'm'},
+	{"bulk",	1, 0, 'B'},
+	{"lazy",	1, 0, 'L'},
+	{"track-used",	0, 0, 'U'},
+	{"bench",	1, 0, 'W'},
+	{"record",	1, 0, 'r'},
+	{"replay",	1, 0, 'R'},
+	{"frag",	0, 0, 'F'},
+	{"free-map",	0, 0, 'M'},
+	{"align",	1, 0, 'A'},
+	{"exact",	0, 0, 'E'},
+	{"policy",	1, 0, 'P'},
+	{"snapshot",	1, 0, 'y'},
+	{"restore",	1, 0, 'Y'},
+	{"shm",		1, 0, 'X'},
+	{"async",	0, 0, 'd'},
+	{"reserve",	1, 0, 'k'},
+	{"hot",		1, 0, 'H'},
+	{"compare",	0, 0, 'C'},
+	{"watermark",	1, 0, 'w'},
 	{NULL,		0, 0,  0 }
 };
 
-static const char *option_str = "hvo:p:s:l:a:n:";
-static struct prog_args_t prog_args;
+static const char *option_str = "hvo:p:s:l:a:n:b:c:t:f:N:S:m:B:L:UW:r:R:FMA:EP:y:Y:X:dk:H:Cw:";
+static struct prog_args_t prog_args;
+
+/*
+ * A fully split region of order n is a complete binary tree with
+ * 2^(n + 1) - 1 nodes, which bounds the live entries. The table is sized
+ * for that once, calloc() leaves the pages untouched until slots are
+ * first handed out, and nothing is allocated after init.
+ */
+static int buddy_pool_init(struct buddy_entry_pool_t *pool, int max_order)
+{
+	if (max_order > BUDDY_POOL_MAX_ORDER) {
+		return -1;
+	}
+	memset(pool, 0, sizeof(*pool));
+	INIT_LIST_HEAD(&pool->free_entries);
+	/* plus what the per-order spares may hold on top of a full tree */
+	pool->total_count = (2 << max_order) - 1 + (max_order + 1) * BUDDY_SPARE_MAX;
+	pool->entries = (struct buddy_entry_t *)calloc(sizeof(*pool->entries),
+			pool->total_count);
+	if (pool->entries == NULL) {
+		return -1;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return 0;
+}
+
+static void buddy_pool_destroy(struct buddy_entry_pool_t *pool)
+{
+	if (pool->entries == NULL) {
+		return;
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->entries);
+	pool->entries = NULL;
+}
+
+static inline void buddy_pool_reset_entry(struct buddy_entry_pool_t *pool,
+		struct buddy_entry_t *entry)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->index = entry - pool->entries;
+	entry->buddy = entry->parent = entry->stack_next = BUDDY_NIL;
+}
+
+/*
+ * Takes the pool lock, never allocates: entries come off the intrusive
+ * freelist threaded through their link field, then off the untouched
+ * tail of the table. Only fails once the whole tree is in use.
+ */
+static int buddy_pool_reserve(struct buddy_entry_pool_t *pool,
+		struct buddy_entry_t **entries, int nr_entries)
+{
+	if (nr_entries == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&pool->lock);
+	if (pool->total_count - pool->used_count < nr_entries) {
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+	for (int i = 0; i < nr_entries; i++) {
+		if (!list_empty(&pool->free_entries)) {
+			entries[i] = list_first_entry(&pool->free_entries, struct buddy_entry_t, link);
+			list_del(&entries[i]->link);
+		} else {
+			entries[i] = &pool->entries[pool->fresh++];
+		}
+		buddy_pool_reset_entry(pool, entries[i]);
+	}
+	pool->used_count += nr_entries;
+	if (pool->used_count > pool->high_water) {
+		pool->high_water = pool->used_count;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+static struct buddy_entry_t* buddy_pool_get(struct buddy_entry_pool_t *pool)
+{
+	struct buddy_entry_t *entry;
+
+	return (buddy_pool_reserve(pool, &entry, 1) == 0) ? entry : NULL;
+}
+
+static void buddy_pool_release(struct buddy_entry_pool_t *pool,
+		struct buddy_entry_t **entries, int nr_entries)
+{
+	if (nr_entries == 0) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	for (int i = 0; i < nr_entries; i++) {
+		entries[i]->order = BUDDY_POOL_FREE;
+		list_add(&entries[i]->link, &pool->free_entries);
+	}
+	pool->used_count -= nr_entries;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void buddy_pool_put(struct buddy_entry_pool_t *pool,
+		struct buddy_entry_t *entry)
+{
+	buddy_pool_release(pool, &entry, 1);
+}
+
+/*
+ * Each order keeps a few spare entries under its own lock: a split into
+ * @order takes its two halves from there and a merge at @order leaves
+ * them there, so the pool lock is only taken per batch, when the spares
+ * run dry or pile up.
+ */
+static int buddy_spare_fill(struct buddy_allocator_t *allocator, int order, int nr)
+{
+	struct buddy_list_t *buddy_list = &allocator->buddy_list[order];
+	struct buddy_entry_t *batch[BUDDY_SPARE_BATCH];
+
+	if (buddy_list->spare_count >= nr) {
+		return 0;
+	}
+	if (buddy_pool_reserve(&allocator->entry_pool, batch, BUDDY_SPARE_BATCH) != 0) {
+		return -1;
+	}
+	for (int i = 0; i < BUDDY_SPARE_BATCH; i++) {
+		batch[i]->order = BUDDY_POOL_FREE;
+		list_add(&batch[i]->link, &buddy_list->spare_entries);
+	}
+	buddy_list->spare_count += BUDDY_SPARE_BATCH;
+
+	return 0;
+}
+
+/* caller made sure with buddy_spare_fill() that one is there */
+static struct buddy_entry_t* buddy_spare_get(struct buddy_allocator_t *allocator, int order)
+{
+	struct buddy_list_t *buddy_list = &allocator->buddy_list[order];
+	struct buddy_entry_t *entry;
+
+	entry = list_first_entry(&buddy_list->spare_entries, struct buddy_entry_t, link);
+	list_del(&entry->link);
+	buddy_list->spare_count--;
+	buddy_pool_reset_entry(&allocator->entry_pool, entry);
+
+	return entry;
+}
+
+static void buddy_spare_put(struct buddy_allocator_t *allocator, int order,
+		struct buddy_entry_t *entry)
+{
+	struct buddy_list_t *buddy_list = &allocator->buddy_list[order];
+	struct buddy_entry_t *batch[BUDDY_SPARE_BATCH];
+
+	entry->order = BUDDY_POOL_FREE;
+	list_add(&entry->link, &buddy_list->spare_entries);
+	if (++buddy_list->spare_count <= BUDDY_SPARE_MAX) {
+		return;
+	}
+	for (int i = 0; i < BUDDY_SPARE_BATCH; i++) {
+		batch[i] = list_first_entry(&buddy_list->spare_entries, struct buddy_entry_t, link);
+		list_del(&batch[i]->link);
+	}
+	buddy_list->spare_count -= BUDDY_SPARE_BATCH;
+	buddy_pool_release(&allocator->entry_pool, batch, BUDDY_SPARE_BATCH);
+}
+
+static inline struct buddy_entry_t* buddy_entry_at(struct buddy_allocator_t *allocator,
+		uint32_t index)
+{
+	if (index == BUDDY_NIL) {
+		return NULL;
+	}
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		return &allocator->frames[index];
+	}
+
+	return &allocator->entry_pool.entries[index];
+}
+
+/* page offset of @addr, which is also its frame in the bitmap backend */
+static inline uint64_t buddy_frame_index(struct buddy_allocator_t *allocator,
+		uint64_t addr)
+{
+	return (addr - allocator->start_addr) >> buddy_shift(allocator);
+}
+
+#ifdef BUDDY_STATS
+static struct buddy_thread_cache_t* buddy_thread_cache(struct buddy_allocator_t *allocator);
+
+/* only the owning thread writes, relaxed accesses let buddy_get_stats() read */
+static inline void buddy_stat_add(unsigned long *counter, unsigned long n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			__ATOMIC_RELAXED);
+}
+
+static inline void buddy_stat_max(unsigned long *counter, unsigned long value)
+{
+	if (value > __atomic_load_n(counter, __ATOMIC_RELAXED)) {
+		__atomic_store_n(counter, value, __ATOMIC_RELAXED);
+	}
+}
+
+static inline struct buddy_order_stats_t* buddy_stats_of(struct buddy_allocator_t *allocator,
+		int order)
+{
+	struct buddy_thread_cache_t *cache = buddy_thread_cache(allocator);
+
+	return (cache != NULL) ? &cache->stats[order] : NULL;
+}
+
+static inline void buddy_stat_alloc(struct buddy_allocator_t *allocator, int order,
+		int allocs, int failures)
+{
+	struct buddy_order_stats_t *stats = buddy_stats_of(allocator, order);
+
+	if (stats != NULL) {
+		buddy_stat_add(&stats->allocs, allocs);
+		buddy_stat_add(&stats->failures, failures);
+	}
+}
+
+static inline void buddy_stat_free(struct buddy_allocator_t *allocator, int order)
+{
+	struct buddy_order_stats_t *stats = buddy_stats_of(allocator, order);
+
+	if (stats != NULL) {
+		buddy_stat_add(&stats->frees, 1);
+	}
+}
+
+static inline void buddy_stat_split(struct buddy_allocator_t *allocator, int order, int depth)
+{
+	struct buddy_order_stats_t *stats = buddy_stats_of(allocator, order);
+
+	if (stats != NULL) {
+		buddy_stat_add(&stats->splits, depth);
+		buddy_stat_max(&stats->max_split_depth, depth);
+	}
+}
+
+static inline void buddy_stat_merge(struct buddy_allocator_t *allocator, int order, int depth)
+{
+	struct buddy_order_stats_t *stats = buddy_stats_of(allocator, order);
+
+	if (stats != NULL) {
+		buddy_stat_add(&stats->merges, depth);
+		buddy_stat_max(&stats->max_merge_depth, depth);
+	}
+}
+#else
+static inline void buddy_stat_alloc(struct buddy_allocator_t *allocator, int order,
+		int allocs, int failures)
+{
+	(void)allocator;
+	(void)order;
+	(void)allocs;
+	(void)failures;
+}
+
+static inline void buddy_stat_free(struct buddy_allocator_t *allocator, int order)
+{
+	(void)allocator;
+	(void)order;
+}
+
+static inline void buddy_stat_split(struct buddy_allocator_t *allocator, int order, int depth)
+{
+	(void)allocator;
+	(void)order;
+	(void)depth;
+}
+
+static inline void buddy_stat_merge(struct buddy_allocator_t *allocator, int order, int depth)
+{
+	(void)allocator;
+	(void)order;
+	(void)depth;
+}
+#endif
+
+/*
+ * free_count only changes under the order lock, but is stored atomically
+ * so buddy_get_frag() can poll it without taking any lock.
+ */
+static inline void buddy_free_count_inc(struct buddy_allocator_t *allocator, int order)
+{
+	int count = allocator->buddy_list[order].free_count;
+
+	__atomic_store_n(&allocator->buddy_list[order].free_count, count + 1, __ATOMIC_RELAXED);
+	if (allocator->low_watermark > 0) {
+		__atomic_fetch_add(&allocator->free_pages, 1ULL << order, __ATOMIC_RELAXED);
+	}
+	if (count == 0) {
+		__atomic_fetch_or(&allocator->free_area_mask, 1ULL << order, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void buddy_free_count_dec(struct buddy_allocator_t *allocator, int order)
+{
+	int count = allocator->buddy_list[order].free_count - 1;
+
+	__atomic_store_n(&allocator->buddy_list[order].free_count, count, __ATOMIC_RELAXED);
+	if (allocator->low_watermark > 0) {
+		__atomic_fetch_sub(&allocator->free_pages, 1ULL << order, __ATOMIC_RELAXED);
+	}
+	if (count == 0) {
+		__atomic_fetch_and(&allocator->free_area_mask, ~(1ULL << order), __ATOMIC_RELAXED);
+	}
+}
+
+static void buddy_addr_set(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry)
+{
+	struct buddy_addr_map_t *map = &allocator->addr_map[entry->order];
+	uint64_t page = buddy_frame_index(allocator, entry->start_addr);
+	uint64_t nr = page >> entry->order;
+
+	if (allocator->free_index != NULL) {
+		allocator->free_index[page] = entry->index;
+	}
+	for (int i = 0; i < map->levels; i++) {
+		unsigned long *word = &map->level[i][nr / BITS_PER_LONG];
+		bool was_empty = (*word == 0);
+
+		*word |= 1UL << (nr % BITS_PER_LONG);
+		if (!was_empty) {
+			break;
+		}
+		nr /= BITS_PER_LONG;
+	}
+}
+
+static void buddy_addr_clear(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry)
+{
+	struct buddy_addr_map_t *map = &allocator->addr_map[entry->order];
+	uint64_t nr = buddy_frame_index(allocator, entry->start_addr) >> entry->order;
+
+	for (int i = 0; i < map->levels; i++) {
+		unsigned long *word = &map->level[i][nr / BITS_PER_LONG];
+
+		*word &= ~(1UL << (nr % BITS_PER_LONG));
+		if (*word != 0) {
+			break;
+		}
+		nr /= BITS_PER_LONG;
+	}
+}
+
+/* caller holds the lock of @order and knows it has a free block */
+static struct buddy_entry_t* buddy_addr_first(struct buddy_allocator_t *allocator, int order)
+{
+	struct buddy_addr_map_t *map = &allocator->addr_map[order];
+	uint64_t nr = 0;
+	uint64_t page;
+
+	for (int i = map->levels - 1; i >= 0; i--) {
+		nr = nr * BITS_PER_LONG + __builtin_ctzl(map->level[i][nr]);
+	}
+	page = nr << order;
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		return &allocator->frames[page];
+	}
+
+	return buddy_entry_at(allocator, allocator->free_index[page]);
+}
+
+/*
+ * Every free block goes on and off its order through these, so the
+ * address map is kept in step with the free lists.
+ */
+static inline void buddy_free_list_add(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	list_add(&entry->link, &allocator->buddy_list[entry->order].free_entries);
+	buddy_free_count_inc(allocator, entry->order);
+	if (allocator->addr_map != NULL) {
+		buddy_addr_set(allocator, entry);
+	}
+}
+
+static inline void buddy_free_list_del(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	list_del(&entry->link);
+	buddy_free_count_dec(allocator, entry->order);
+	if (allocator->addr_map != NULL) {
+		buddy_addr_clear(allocator, entry);
+	}
+}
+
+static inline struct buddy_entry_t* buddy_free_list_first(struct buddy_allocator_t *allocator,
+		int order)
+{
+	if (allocator->addr_map != NULL) {
+		return buddy_addr_first(allocator, order);
+	}
+
+	return list_first_entry(&allocator->buddy_list[order].free_entries,
+			struct buddy_entry_t, link);
+}
+
+/*
+ * Smallest order >= @order with a free block, or -1 when none is left.
+ * Without the order locks held this is only a hint.
+ */
+static inline int buddy_find_free_order(struct buddy_allocator_t *allocator, int order)
+{
+	uint64_t avail;
+
+	if (order > buddy_max_order(allocator)) {
+		return -1;
+	}
+	avail = __atomic_load_n(&allocator->free_area_mask, __ATOMIC_RELAXED) >> order;
+	if (avail == 0) {
+		return -1;
+	}
+
+	return order + __builtin_ctzll(avail);
+}
+
+static inline void buddy_lock_order(struct buddy_allocator_t *allocator, int order)
+{
+	pthread_mutex_lock(&allocator->buddy_list[order].lock);
+}
+
+static inline void buddy_unlock_order(struct buddy_allocator_t *allocator, int order)
+{
+	pthread_mutex_unlock(&allocator->buddy_list[order].lock);
+}
+
+static void buddy_unlock_orders(struct buddy_allocator_t *allocator, int from, int to)
+{
+	for (int i = to; i >= from; i--) {
+		buddy_unlock_order(allocator, i);
+	}
+}
+
+/*
+ * Called with the lock of @order held. Locks upward until an order with a
+ * free block is found and returns it with every lock from @order to it
+ * held, or returns -1 with only the lock of @order still held.
+ */
+static int buddy_lock_free_order(struct buddy_allocator_t *allocator, int order)
+{
+	int cur = order;
+
+	while (allocator->buddy_list[cur].free_count == 0) {
+		int next = buddy_find_free_order(allocator, cur + 1);
+
+		if (next < 0) {
+			buddy_unlock_orders(allocator, order + 1, cur);
+			return -1;
+		}
+		while (cur < next) {
+			buddy_lock_order(allocator, ++cur);
+			if (allocator->buddy_list[cur].free_count > 0) {
+				break;
+			}
+		}
+	}
+
+	return cur;
+}
+
+static inline void buddy_unlink_entry(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	if (!entry->is_used || allocator->track_used) {
+		list_del(&entry->link);
+	}
+}
+
+static inline void buddy_link_used_entry(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	struct buddy_list_t *buddy_list = &allocator->buddy_list[entry->order];
+
+	if (allocator->track_used) {
+		list_add(&entry->link, &buddy_list->used_entries);
+	}
+	buddy_list->used_count++;
+}
+
+static void buddy_add_free_entry(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	struct buddy_list_t *buddy_list = &allocator->buddy_list[entry->order];
+
+	if (entry->is_used) {
+		buddy_unlink_entry(allocator, entry);
+		buddy_list->used_count--;
+	}
+	entry->is_used = false;
+	buddy_free_list_add(allocator, entry);
+}
+
+static void buddy_remove_free_entry(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	buddy_free_list_del(allocator, entry);
+	entry->is_used = true;
+	buddy_link_used_entry(allocator, entry);
+}
+
+static void buddy_recycle_entry(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	struct buddy_list_t *buddy_list = &allocator->buddy_list[entry->order];
+	struct buddy_entry_t *buddy = buddy_entry_at(allocator, entry->buddy);
+
+	buddy_list->merges++;
+	if (entry->is_used) {
+		buddy_unlink_entry(allocator, entry);
+		buddy_list->used_count--;
+	} else {
+		buddy_free_list_del(allocator, entry);
+	}
+	if (buddy->is_used) {
+		buddy_unlink_entry(allocator, buddy);
+		buddy_list->used_count--;
+	} else {
+		buddy_free_list_del(allocator, buddy);
+	}
+
+	buddy_spare_put(allocator, entry->order, buddy);
+	buddy_spare_put(allocator, entry->order, entry);
+}
+
+static inline bool buddy_test_and_change_bit(unsigned long *map, unsigned long nr)
+{
+	unsigned long mask = 1UL << (nr % BITS_PER_LONG);
+	unsigned long *word = &map[nr / BITS_PER_LONG];
+	bool old = (*word & mask) != 0;
+
+	*word ^= mask;
+
+	return old;
+}
+
+static inline bool buddy_test_bit(const unsigned long *map, unsigned long nr)
+{
+	return (map[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static int buddy_bitmap_init(struct buddy_allocator_t *allocator)
+{
+	int max_order = buddy_max_order(allocator);
+	unsigned long *map;
+	size_t nr_words = 0;
+
+	if (max_order > BUDDY_BITMAP_MAX_ORDER) {
+		return -1;
+	}
+	allocator->frames = (struct buddy_entry_t *)calloc(sizeof(struct buddy_entry_t),
+			1UL << max_order);
+	allocator->pair_map = (unsigned long **)calloc(sizeof(unsigned long *),
+			max_order + 1);
+	/* order k has 2^(max_order - k - 1) buddy pairs, max_order has none */
+	for (int i = 0; i < max_order; i++) {
+		nr_words += ((1UL << (max_order - i - 1)) + BITS_PER_LONG - 1) /
+			BITS_PER_LONG;
+	}
+	map = (unsigned long *)calloc(sizeof(unsigned long), nr_words + 1);
+	if (allocator->frames == NULL || allocator->pair_map == NULL || map == NULL) {
+		free(allocator->frames);
+		free(allocator->pair_map);
+		free(map);
+		return -1;
+	}
+	for (uint32_t i = 0; i < 1U << max_order; i++) {
+		allocator->frames[i].index = i;
+	}
+	for (int i = 0; i < max_order; i++) {
+		allocator->pair_map[i] = map;
+		map += ((1UL << (max_order - i - 1)) + BITS_PER_LONG - 1) /
+			BITS_PER_LONG;
+	}
+	allocator->pair_map[max_order] = map;
+
+	return 0;
+}
+
+/* words of level @level of an address map covering @nr_bits blocks */
+static inline size_t buddy_addr_map_words(uint64_t nr_bits, int level)
+{
+	size_t words = (nr_bits + BITS_PER_LONG - 1) / BITS_PER_LONG;
+
+	while (level-- > 0) {
+		words = (words + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	}
+
+	return words;
+}
+
+static int buddy_addr_map_init(struct buddy_allocator_t *allocator)
+{
+	int max_order = buddy_max_order(allocator);
+	unsigned long *map;
+	size_t nr_words = 0;
+
+	if (allocator->policy != BUDDY_POLICY_ADDRESS) {
+		return 0;
+	}
+	if (max_order > BUDDY_BITMAP_MAX_ORDER) {
+		return -1;
+	}
+	allocator->addr_map = (struct buddy_addr_map_t *)calloc(sizeof(struct buddy_addr_map_t),
+			max_order + 1);
+	if (allocator->backend == BUDDY_BACKEND_LIST) {
+		allocator->free_index = (uint32_t *)malloc(sizeof(uint32_t) << max_order);
+	}
+	for (int i = 0; i <= max_order; i++) {
+		for (int level = 0; ; level++) {
+			size_t words = buddy_addr_map_words(1ULL << (max_order - i), level);
+
+			nr_words += words;
+			if (words == 1) {
+				break;
+			}
+		}
+	}
+	map = (unsigned long *)calloc(sizeof(unsigned long), nr_words);
+	if (allocator->addr_map == NULL || map == NULL ||
+			(allocator->backend == BUDDY_BACKEND_LIST && allocator->free_index == NULL)) {
+		free(allocator->addr_map);
+		free(allocator->free_index);
+		free(map);
+		allocator->addr_map = NULL;
+		allocator->free_index = NULL;
+		return -1;
+	}
+	for (int i = 0; i <= max_order; i++) {
+		struct buddy_addr_map_t *addr_map = &allocator->addr_map[i];
+		size_t words;
+
+		do {
+			words = buddy_addr_map_words(1ULL << (max_order - i), addr_map->levels);
+			addr_map->level[addr_map->levels++] = map;
+			map += words;
+		} while (words > 1);
+	}
+
+	return 0;
+}
+
+static void buddy_addr_map_release(struct buddy_allocator_t *allocator)
+{
+	if (allocator->addr_map != NULL) {
+		free(allocator->addr_map[0].level[0]);
+		free(allocator->addr_map);
+		allocator->addr_map = NULL;
+	}
+	free(allocator->free_index);
+	allocator->free_index = NULL;
+}
+
+static void buddy_bitmap_release(struct buddy_allocator_t *allocator)
+{
+	if (allocator->pair_map != NULL) {
+		free(allocator->pair_map[0]);
+		free(allocator->pair_map);
+		allocator->pair_map = NULL;
+	}
+	free(allocator->frames);
+	allocator->frames = NULL;
+}
+
+static size_t buddy_metadata_size(struct buddy_allocator_t *allocator)
+{
+	size_t size = sizeof(struct buddy_list_t) * (buddy_max_order(allocator) + 1);
+
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		size += sizeof(struct buddy_entry_t) << buddy_max_order(allocator);
+		size += sizeof(unsigned long *) * (buddy_max_order(allocator) + 1);
+		for (int i = 0; i < buddy_max_order(allocator); i++) {
+			size += sizeof(unsigned long) *
+				(((1UL << (buddy_max_order(allocator) - i - 1)) +
+				  BITS_PER_LONG - 1) / BITS_PER_LONG);
+		}
+	} else {
+		/* the untouched tail of the table costs no memory */
+		size += allocator->entry_pool.fresh * sizeof(struct buddy_entry_t);
+	}
+	if (allocator->block_map != NULL) {
+		size += sizeof(struct buddy_entry_t *) << buddy_max_order(allocator);
+	}
+	for (int i = 0; allocator->addr_map != NULL && i <= buddy_max_order(allocator); i++) {
+		size += sizeof(struct buddy_addr_map_t);
+		for (int level = 0; level < allocator->addr_map[i].levels; level++) {
+			size += sizeof(unsigned long) *
+				buddy_addr_map_words(1ULL << (buddy_max_order(allocator) - i), level);
+		}
+	}
+	if (allocator->free_index != NULL) {
+		size += sizeof(uint32_t) << buddy_max_order(allocator);
+	}
+	size += sizeof(struct buddy_slab_cache_t) * allocator->nr_slab_classes;
+
+	return size;
+}
+
+/*
+ * ceil(log2(pages)) for pages >= 1.
+ */
+static inline int buddy_pages_to_order(uint64_t pages)
+{
+	if (pages <= 1) {
+		return 0;
+	}
+
+	return 64 - __builtin_clzll(pages - 1);
+}
+
+static void buddy_size_class_init(struct buddy_allocator_t *allocator)
+{
+	for (int i = 0; i <= BUDDY_SIZE_CLASS_PAGES; i++) {
+		allocator->size_class[i] = buddy_pages_to_order(i);
+	}
+}
+
+static inline int buddy_size_to_order(struct buddy_allocator_t *allocator,
+		uint64_t size)
+{
+	uint64_t pages = (size >> buddy_shift(allocator)) +
+		((size & (buddy_page_size(allocator) - 1)) != 0);
+
+	if (pages <= BUDDY_SIZE_CLASS_PAGES) {
+		return allocator->size_class[pages];
+	}
+
+	return buddy_pages_to_order(pages);
+}
+
+static int buddy_memory_init(struct buddy_allocator_t *allocator)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	allocator->base = NULL;
+	allocator->block_map = NULL;
+	if (allocator->backend == BUDDY_BACKEND_LIST &&
+			(allocator->memory != BUDDY_MEMORY_NONE || allocator->handles)) {
+		allocator->block_map = (struct buddy_entry_t **)calloc(sizeof(struct buddy_entry_t *),
+				1UL << buddy_max_order(allocator));
+		if (allocator->block_map == NULL) {
+			return -1;
+		}
+	}
+	if (allocator->memory == BUDDY_MEMORY_NONE) {
+		return 0;
+	}
+	allocator->region_size = (size_t)buddy_page_size(allocator) << buddy_max_order(allocator);
+	if (allocator->memory == BUDDY_MEMORY_HUGETLB) {
+		flags |= MAP_HUGETLB;
+	}
+	allocator->base = mmap(NULL, allocator->region_size, PROT_READ | PROT_WRITE,
+			flags, -1, 0);
+	if (allocator->base == MAP_FAILED) {
+		msg_err("mmap of %zu bytes failed: %s", allocator->region_size,
+				strerror(errno));
+		allocator->base = NULL;
+		return -1;
+	}
+	if (allocator->memory == BUDDY_MEMORY_THP &&
+			madvise(allocator->base, allocator->region_size, MADV_HUGEPAGE) != 0) {
+		msg_err("MADV_HUGEPAGE failed: %s", strerror(errno));
+	}
+
+	return 0;
+}
+
+static void buddy_memory_destroy(struct buddy_allocator_t *allocator)
+{
+	if (allocator->base != NULL) {
+		munmap(allocator->base, allocator->region_size);
+		allocator->base = NULL;
+	}
+	free(allocator->block_map);
+	allocator->block_map = NULL;
+}
+
+static inline uint64_t buddy_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct buddy_trace_t* buddy_trace_open(const char *path)
+{
+	struct buddy_trace_header_t header = { .magic = BUDDY_TRACE_MAGIC };
+	struct buddy_trace_t *trace;
+
+	trace = (struct buddy_trace_t *)calloc(sizeof(*trace), 1);
+	if (trace == NULL) {
+		return NULL;
+	}
+	trace->file = fopen(path, "wb");
+	/* placeholder, rewritten with the final counts on close */
+	if (trace->file == NULL || fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+		if (trace->file != NULL) {
+			fclose(trace->file);
+		}
+		free(trace);
+		return NULL;
+	}
+	pthread_mutex_init(&trace->lock, NULL);
+	trace->start = buddy_trace_now();
+
+	return trace;
+}
+
+static inline uint32_t buddy_trace_id(struct buddy_allocator_t *allocator, uint32_t index)
+{
+	return index * allocator->trace_stride + allocator->trace_node;
+}
+
+static void buddy_trace_record(struct buddy_trace_t *trace, int op, uint64_t size,
+		uint32_t handle)
+{
+	struct buddy_trace_record_t record = {
+		.size = size,
+		.handle = handle,
+		.op = op,
+	};
+
+	pthread_mutex_lock(&trace->lock);
+	record.timestamp = buddy_trace_now() - trace->start;
+	fwrite(&record, sizeof(record), 1, trace->file);
+	trace->nr_records++;
+	if (handle >= trace->nr_handles) {
+		trace->nr_handles = handle + 1;
+	}
+	pthread_mutex_unlock(&trace->lock);
+}
+
+static int buddy_trace_close(struct buddy_trace_t *trace)
+{
+	struct buddy_trace_header_t header = {
+		.magic = BUDDY_TRACE_MAGIC,
+		.version = BUDDY_TRACE_VERSION,
+		.record_size = sizeof(struct buddy_trace_record_t),
+	};
+	int ret = 0;
+
+	if (trace == NULL) {
+		return 0;
+	}
+	header.nr_records = trace->nr_records;
+	header.nr_handles = trace->nr_handles;
+	if (fseek(trace->file, 0, SEEK_SET) != 0 ||
+			fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+		ret = -1;
+	}
+	if (fclose(trace->file) != 0) {
+		ret = -1;
+	}
+	pthread_mutex_destroy(&trace->lock);
+	free(trace);
+
+	return ret;
+}
+
+static int buddy_cache_init(struct buddy_allocator_t *allocator);
+static int buddy_slab_init(struct buddy_allocator_t *allocator);
+static void buddy_slab_destroy(struct buddy_allocator_t *allocator);
+static void buddy_cache_destroy(struct buddy_allocator_t *allocator);
+static void buddy_allocator_destroy(struct buddy_allocator_t *allocator);
+static int buddy_coalescer_start(struct buddy_allocator_t *allocator);
+static void buddy_coalescer_stop(struct buddy_allocator_t *allocator);
+static void buddy_shrinker_init(struct buddy_allocator_t *allocator);
+static void buddy_shrinker_destroy(struct buddy_allocator_t *allocator);
+static void buddy_pressure_check(struct buddy_allocator_t *allocator);
+
+static int buddy_allocator_init(struct buddy_allocator_t *allocator)
+{
+	struct buddy_entry_t *first_entry;
+
+	int shift_count = ffs(allocator->page_size) - 1;
+
+	if (allocator->backend == BUDDY_BACKEND_BITMAP && buddy_defers_merges(allocator)) {
+		/* a pair bit cannot describe two free, unmerged buddies */
+		return -1;
+	}
+	/* the whole region has to be addressable in 64 bits */
+	if (allocator->max_order < 0 || allocator->max_order > BUDDY_MAX_ORDER ||
+			shift_count < 0 || allocator->max_order + shift_count >= 64 ||
+			allocator->start_addr + (((uint64_t)allocator->page_size <<
+					allocator->max_order) - 1) < allocator->start_addr) {
+		return -1;
+	}
+	if (!buddy_geometry_matches(allocator)) {
+		return -1;
+	}
+	if (allocator->hot_reserve > 0 &&
+			(allocator->hot_order < 0 || allocator->hot_order > allocator->max_order)) {
+		return -1;
+	}
+	if (buddy_list_alloc(allocator) != 0) {
+		return -1;
+	}
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		if (buddy_bitmap_init(allocator) != 0) {
+			buddy_list_release(allocator);
+			return -1;
+		}
+	} else if (buddy_pool_init(&allocator->entry_pool, buddy_max_order(allocator)) != 0) {
+		buddy_list_release(allocator);
+		return -1;
+	}
+	if (buddy_addr_map_init(allocator) != 0) {
+		buddy_pool_destroy(&allocator->entry_pool);
+		buddy_bitmap_release(allocator);
+		buddy_list_release(allocator);
+		return -1;
+	}
+
+	allocator->shift_count = shift_count;
+	allocator->free_area_mask = 0;
+	allocator->bytes_requested = 0;
+	allocator->bytes_allocated = 0;
+	allocator->compactions = 0;
+	if (allocator->trace_stride == 0) {
+		allocator->trace_stride = 1;
+	}
+	buddy_size_class_init(allocator);
+	if (allocator->lockfree_orders > BUDDY_LF_ORDERS_MAX) {
+		allocator->lockfree_orders = BUDDY_LF_ORDERS_MAX;
+	}
+	if (allocator->lockfree_orders > buddy_max_order(allocator) + 1) {
+		allocator->lockfree_orders = buddy_max_order(allocator) + 1;
+	}
+	if (allocator->lockfree_depth <= 0) {
+		allocator->lockfree_depth = BUDDY_LF_DEPTH;
+	}
+	memset(allocator->lf_stack, 0, sizeof(allocator->lf_stack));
+	for (int i = 0; i < BUDDY_LF_ORDERS_MAX; i++) {
+		allocator->lf_stack[i].head = BUDDY_NIL;
+	}
+	memset(&allocator->hot, 0, sizeof(allocator->hot));
+	allocator->hot.stack.head = BUDDY_NIL;
+	if (allocator->hot_reserve > 0) {
+		if (allocator->hot_reserve > BUDDY_HOT_DEPTH_MAX) {
+			allocator->hot_reserve = BUDDY_HOT_DEPTH_MAX;
+		}
+		allocator->hot.max_size = (uint64_t)buddy_page_size(allocator) << allocator->hot_order;
+		allocator->hot.min_size = (allocator->hot_order == 0) ? 0 :
+			(allocator->hot.max_size >> 1) + 1;
+	}
+	pthread_mutex_init(&allocator->lock, NULL);
+	if (buddy_cache_init(allocator) != 0) {
+		pthread_mutex_destroy(&allocator->lock);
+		buddy_allocator_destroy(allocator);
+		return -1;
+	}
+	buddy_shrinker_init(allocator);
+	allocator->free_pages = 0;
+	allocator->under_pressure = false;
+	allocator->pressure_events = 0;
+	if (allocator->low_watermark > 0 && allocator->high_watermark <= allocator->low_watermark) {
+		allocator->high_watermark = 2 * allocator->low_watermark;
+	}
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		first_entry = &allocator->frames[0];
+	} else {
+		first_entry = buddy_pool_get(&allocator->entry_pool);
+	}
+	first_entry->start_addr = allocator->start_addr;
+	first_entry->order = buddy_max_order(allocator);
+	first_entry->buddy = BUDDY_NIL;
+	first_entry->parent = BUDDY_NIL;
+	first_entry->is_used = false;
+	for (int i = 0; i <= buddy_max_order(allocator); i++) {
+		pthread_mutex_init(&allocator->buddy_list[i].lock, NULL);
+		allocator->buddy_list[i].free_count = 0;
+		allocator->buddy_list[i].used_count = 0;
+		INIT_LIST_HEAD(&allocator->buddy_list[i].free_entries);
+		INIT_LIST_HEAD(&allocator->buddy_list[i].used_entries);
+		INIT_LIST_HEAD(&allocator->buddy_list[i].spare_entries);
+		allocator->buddy_list[i].spare_count = 0;
+	}
+	buddy_add_free_entry(allocator, first_entry);
+	if (buddy_memory_init(allocator) != 0 || buddy_slab_init(allocator) != 0 ||
+			(allocator->async_free && buddy_coalescer_start(allocator) != 0)) {
+		buddy_allocator_destroy(allocator);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void buddy_allocator_destroy(struct buddy_allocator_t *allocator)
+{
+	if (buddy_trace_close(allocator->trace) != 0) {
+		msg_err("failed to write allocation trace");
+	}
+	allocator->trace = NULL;
+	buddy_coalescer_stop(allocator);
+	buddy_slab_destroy(allocator);
+	if (allocator->caches.next != NULL) {
+		buddy_shrinker_destroy(allocator);
+		buddy_cache_destroy(allocator);
+		pthread_mutex_destroy(&allocator->lock);
+	}
+	buddy_memory_destroy(allocator);
+	buddy_pool_destroy(&allocator->entry_pool);
+	buddy_addr_map_release(allocator);
+	buddy_bitmap_release(allocator);
+	buddy_list_release(allocator);
+}
+
+static struct buddy_entry_t* buddy_split_entry(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry, struct buddy_entry_t **new_entry)
+{
+	int new_order = entry->order - 1;
+	uint64_t buddy_size = (uint64_t)buddy_page_size(allocator) << new_order;
+
+	allocator->buddy_list[new_order].splits++;
+	for ( int i = 0; i < 2; i++ ) {
+		new_entry[i]->start_addr = entry->start_addr + i * buddy_size;
+		new_entry[i]->order = new_order;
+		new_entry[i]->parent = entry->index;
+		INIT_LIST_HEAD(&new_entry[i]->link);
+		new_entry[i]->is_used = false;
+		buddy_add_free_entry(allocator, new_entry[i]);
+	}
+	new_entry[0]->buddy = new_entry[1]->index;
+	new_entry[1]->buddy = new_entry[0]->index;
+
+	return new_entry[1];
+}
+
+/*
+ * Called with the lock of @order held, returns with only that lock held.
+ */
+static struct buddy_entry_t* buddy_alloc_internal(struct buddy_allocator_t *allocator, int order)
+{
+	struct buddy_entry_t *new_entries[2 * (BUDDY_MAX_ORDER + 1)];
+	struct buddy_entry_t *buddy_entry;
+	int cur = buddy_lock_free_order(allocator, order);
+	int top = cur;
+
+	if (cur < 0) {
+		return NULL;
+	}
+	/* take every entry the split needs up front so it cannot fail midway */
+	for (int i = order; i < cur; i++) {
+		if (buddy_spare_fill(allocator, i, 2) != 0) {
+			buddy_unlock_orders(allocator, order + 1, top);
+			return NULL;
+		}
+	}
+	for (int i = order; i < cur; i++) {
+		new_entries[2 * (i - order)] = buddy_spare_get(allocator, i);
+		new_entries[2 * (i - order) + 1] = buddy_spare_get(allocator, i);
+	}
+
+	buddy_entry = buddy_free_list_first(allocator, cur);
+	buddy_remove_free_entry(allocator, buddy_entry);
+	while (cur > order) {
+		cur--;
+		buddy_entry = buddy_split_entry(allocator, buddy_entry,
+				&new_entries[2 * (cur - order)]);
+		/* keep to the bottom of the block, the upper half stays free */
+		if (allocator->policy == BUDDY_POLICY_ADDRESS) {
+			buddy_entry = buddy_entry_at(allocator, buddy_entry->buddy);
+		}
+		buddy_remove_free_entry(allocator, buddy_entry);
+	}
+	buddy_unlock_orders(allocator, order + 1, top);
+	buddy_stat_split(allocator, order, top - order);
+
+	return buddy_entry;
+}
+
+/*
+ * Called with the lock of entry->order held, returns with only that lock
+ * held. Merging hands the lock over one order at a time, the merged block
+ * belongs to nobody else while it is in flight.
+ */
+static void buddy_free_internal(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry)
+{
+	int base = entry->order;
+
+	while (entry->buddy != BUDDY_NIL &&
+			!buddy_entry_at(allocator, entry->buddy)->is_used &&
+			allocator->buddy_list[entry->order].free_count >=
+			buddy_merge_watermark(allocator, entry->order)) {
+		struct buddy_entry_t *parent = buddy_entry_at(allocator, entry->parent);
+		int order = entry->order;
+
+		buddy_recycle_entry(allocator, entry);
+		buddy_lock_order(allocator, order + 1);
+		if (order != base) {
+			buddy_unlock_order(allocator, order);
+		}
+		entry = parent;
+	}
+	buddy_add_free_entry(allocator, entry);
+	if (entry->order != base) {
+		buddy_unlock_order(allocator, entry->order);
+	}
+	buddy_stat_merge(allocator, base, entry->order - base);
+}
+
+/*
+ * Merge every free block whose buddy is free too, bottom up, so a single
+ * pass coalesces all the way. Takes the order locks itself and returns
+ * the number of merges.
+ */
+static int buddy_compact(struct buddy_allocator_t *allocator)
+{
+	int merged = 0;
+
+	if (allocator->backend != BUDDY_BACKEND_LIST) {
+		return 0;
+	}
+	__atomic_fetch_add(&allocator->compactions, 1, __ATOMIC_RELAXED);
+	for (int order = 0; order < buddy_max_order(allocator); order++) {
+		struct buddy_list_t *buddy_list = &allocator->buddy_list[order];
+		LIST_HEAD(kept);
+
+		buddy_lock_order(allocator, order);
+		while (!list_empty(&buddy_list->free_entries)) {
+			struct buddy_entry_t *entry = list_first_entry(&buddy_list->free_entries,
+					struct buddy_entry_t, link);
+			struct buddy_entry_t *parent = buddy_entry_at(allocator, entry->parent);
+
+			if (entry->buddy == BUDDY_NIL ||
+					buddy_entry_at(allocator, entry->buddy)->is_used) {
+				list_move(&entry->link, &kept);
+				continue;
+			}
+			buddy_recycle_entry(allocator, entry);
+			buddy_lock_order(allocator, order + 1);
+			buddy_add_free_entry(allocator, parent);
+			buddy_unlock_order(allocator, order + 1);
+			merged++;
+		}
+		list_splice(&kept, &buddy_list->free_entries);
+		buddy_unlock_order(allocator, order);
+	}
+
+	return merged;
+}
+
+/*
+ * Bitmap backend: blocks are identified by the frame of their first page
+ * and the per-order pair bit holds (buddy A free) ^ (buddy B free), as in
+ * the classic Linux free_area map. Buddies are found by address
+ * arithmetic, so no buddy/parent pointers are ever followed.
+ */
+static inline uint64_t buddy_buddy_addr(struct buddy_allocator_t *allocator,
+		uint64_t addr, int order)
+{
+	uint64_t offset = addr - allocator->start_addr;
+
+	return allocator->start_addr + (offset ^ (1ULL << (order + buddy_shift(allocator))));
+}
+
+static struct buddy_entry_t* buddy_bitmap_alloc(struct buddy_allocator_t *allocator,
+		int order)
+{
+	struct buddy_entry_t *entry;
+	int cur = buddy_lock_free_order(allocator, order);
+	int top = cur;
+
+	if (cur < 0) {
+		return NULL;
+	}
+
+	entry = buddy_free_list_first(allocator, cur);
+	buddy_free_list_del(allocator, entry);
+	if (cur < buddy_max_order(allocator)) {
+		buddy_test_and_change_bit(allocator->pair_map[cur],
+				buddy_frame_index(allocator, entry->start_addr) >> (cur + 1));
+	}
+
+	/* hand the upper halves back while walking down to the wanted order */
+	while (cur > order) {
+		uint64_t addr;
+		struct buddy_entry_t *half;
+
+		/* the block being split stays counted at its order, as a list parent */
+		allocator->buddy_list[cur].used_count++;
+		cur--;
+		addr = buddy_buddy_addr(allocator, entry->start_addr, cur);
+		allocator->buddy_list[cur].splits++;
+		half = &allocator->frames[buddy_frame_index(allocator, addr)];
+		half->start_addr = addr;
+		half->order = cur;
+		half->is_used = false;
+		buddy_free_list_add(allocator, half);
+		buddy_test_and_change_bit(allocator->pair_map[cur],
+				buddy_frame_index(allocator, addr) >> (cur + 1));
+	}
+
+	entry->order = order;
+	entry->is_used = true;
+	buddy_link_used_entry(allocator, entry);
+	buddy_unlock_orders(allocator, order + 1, top);
+	buddy_stat_split(allocator, order, top - order);
+
+	return entry;
+}
+
+static void buddy_bitmap_free(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	uint64_t addr = entry->start_addr;
+	int base = entry->order;
+	int order = base;
+
+	buddy_unlink_entry(allocator, entry);
+	allocator->buddy_list[order].used_count--;
+	entry->is_used = false;
+
+	while (order < buddy_max_order(allocator)) {
+		uint64_t index = buddy_frame_index(allocator, addr);
+		struct buddy_entry_t *buddy;
+
+		/* bit was clear: the buddy is not free at this order, stop here */
+		if (!buddy_test_and_change_bit(allocator->pair_map[order], index >> (order + 1))) {
+			break;
+		}
+		buddy = &allocator->frames[buddy_frame_index(allocator,
+				buddy_buddy_addr(allocator, addr, order))];
+		buddy_free_list_del(allocator, buddy);
+		allocator->buddy_list[order].merges++;
+		if (buddy->start_addr < addr) {
+			addr = buddy->start_addr;
+		}
+		buddy_lock_order(allocator, order + 1);
+		/* the split parent is whole again */
+		allocator->buddy_list[order + 1].used_count--;
+		if (order != base) {
+			buddy_unlock_order(allocator, order);
+		}
+		order++;
+	}
+
+	entry = &allocator->frames[buddy_frame_index(allocator, addr)];
+	entry->start_addr = addr;
+	entry->order = order;
+	entry->is_used = false;
+	buddy_free_list_add(allocator, entry);
+	if (order != base) {
+		buddy_unlock_order(allocator, order);
+	}
+	buddy_stat_merge(allocator, base, order - base);
+}
+
+/*
+ * Backend dispatch on the shared buddy lists, caller holds the lock of the
+ * order being allocated or freed.
+ */
+static struct buddy_entry_t* buddy_alloc_shared(struct buddy_allocator_t *allocator,
+		int order)
+{
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		return buddy_bitmap_alloc(allocator, order);
+	}
+
+	return buddy_alloc_internal(allocator, order);
+}
+
+static void buddy_free_shared(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		buddy_bitmap_free(allocator, entry);
+		return;
+	}
+	buddy_free_internal(allocator, entry);
+}
+
+/*
+ * Caller holds the lock of @order. The first allocation splits a larger
+ * block once and leaves a free half at every order on the way down, so
+ * the following ones are mostly plain pops off buddy_list[order].
+ */
+static int buddy_alloc_shared_bulk(struct buddy_allocator_t *allocator, int order,
+		int nr, struct buddy_entry_t **out)
+{
+	int count;
+
+	for (count = 0; count < nr; count++) {
+		out[count] = buddy_alloc_shared(allocator, order);
+		if (out[count] == NULL) {
+			break;
+		}
+	}
+
+	return count;
+}
+
+/* returns the number of blocks handed back to the shared lists */
+static int buddy_cache_flush(struct buddy_allocator_t *allocator,
+		struct buddy_magazine_t *mag, int order, int keep)
+{
+	int flushed = 0;
+
+	if (mag->count <= keep) {
+		return 0;
+	}
+	buddy_lock_order(allocator, order);
+	while (mag->count > keep) {
+		buddy_free_shared(allocator, mag->slots[--mag->count]);
+		flushed++;
+	}
+	buddy_unlock_order(allocator, order);
+
+	return flushed;
+}
+
+static int buddy_cache_empty(struct buddy_thread_cache_t *cache)
+{
+	int flushed = 0;
+
+	for (int i = 0; i < BUDDY_CACHE_ORDERS; i++) {
+		flushed += buddy_cache_flush(cache->allocator, &cache->mag[i], i, 0);
+	}
+
+	return flushed;
+}
+
+static void buddy_cache_release(void *data)
+{
+	/* the owning thread is gone, keep the struct around for statistics */
+	buddy_cache_empty((struct buddy_thread_cache_t *)data);
+}
+
+static int buddy_cache_init(struct buddy_allocator_t *allocator)
+{
+	if (pthread_key_create(&allocator->cache_key, buddy_cache_release) != 0) {
+		return -1;
+	}
+	INIT_LIST_HEAD(&allocator->caches);
+	allocator->nr_caches = 0;
+	for (int i = 0; i < BUDDY_CACHE_ORDERS; i++) {
+		if (allocator->cache_depth[i] < 0) {
+			allocator->cache_depth[i] = 0;
+		} else if (allocator->cache_depth[i] > BUDDY_CACHE_DEPTH_MAX) {
+			allocator->cache_depth[i] = BUDDY_CACHE_DEPTH_MAX;
+		}
+	}
+
+	return 0;
+}
+
+static void buddy_cache_destroy(struct buddy_allocator_t *allocator)
+{
+	struct buddy_thread_cache_t *cache, *tmp;
+
+	pthread_key_delete(allocator->cache_key);
+	list_for_each_entry_safe(cache, tmp, &allocator->caches, link) {
+		buddy_cache_release(cache);
+		list_del(&cache->link);
+		free(cache);
+	}
+}
+
+static struct buddy_thread_cache_t* buddy_thread_cache(struct buddy_allocator_t *allocator)
+{
+	struct buddy_thread_cache_t *cache;
+
+	cache = (struct buddy_thread_cache_t *)pthread_getspecific(allocator->cache_key);
+	if (cache != NULL) {
+		return cache;
+	}
+
+	/* own cache lines, so neighbouring threads' magazines do not false share */
+	if (posix_memalign((void **)&cache, 64, sizeof(*cache)) != 0) {
+		return NULL;
+	}
+	memset(cache, 0, sizeof(*cache));
+	cache->allocator = allocator;
+	for (int i = 0; i < BUDDY_CACHE_ORDERS; i++) {
+		cache->mag[i].depth = allocator->cache_depth[i];
+	}
+	pthread_mutex_lock(&allocator->lock);
+	cache->id = allocator->nr_caches++;
+	list_add_tail(&cache->link, &allocator->caches);
+	pthread_mutex_unlock(&allocator->lock);
+	pthread_setspecific(allocator->cache_key, cache);
+
+	return cache;
+}
+
+/*
+ * Return the calling thread's cached blocks to the shared lists.
+ */
+static void buddy_thread_cache_drain(struct buddy_allocator_t *allocator)
+{
+	struct buddy_thread_cache_t *cache;
+
+	cache = (struct buddy_thread_cache_t *)pthread_getspecific(allocator->cache_key);
+	if (cache != NULL) {
+		buddy_cache_release(cache);
+	}
+}
+
+static struct buddy_entry_t* buddy_cache_alloc(struct buddy_allocator_t *allocator,
+		struct buddy_magazine_t *mag, int order)
+{
+	if (mag->count > 0) {
+		mag->alloc_hits++;
+		return mag->slots[--mag->count];
+	}
+
+	mag->alloc_misses++;
+	buddy_lock_order(allocator, order);
+	mag->count = buddy_alloc_shared_bulk(allocator, order, (mag->depth + 1) / 2,
+			mag->slots);
+	buddy_unlock_order(allocator, order);
+	if (mag->count == 0 && buddy_defers_merges(allocator)) {
+		buddy_compact(allocator);
+		buddy_lock_order(allocator, order);
+		mag->count = buddy_alloc_shared_bulk(allocator, order, (mag->depth + 1) / 2,
+				mag->slots);
+		buddy_unlock_order(allocator, order);
+	}
+
+	return (mag->count > 0) ? mag->slots[--mag->count] : NULL;
+}
+
+static void buddy_cache_free(struct buddy_allocator_t *allocator,
+		struct buddy_magazine_t *mag, struct buddy_entry_t *entry)
+{
+	if (mag->count < mag->depth) {
+		mag->free_hits++;
+	} else {
+		mag->free_misses++;
+		buddy_cache_flush(allocator, mag, entry->order, mag->depth / 2);
+	}
+	mag->slots[mag->count++] = entry;
+}
+
+static inline bool buddy_caches_enabled(struct buddy_allocator_t *allocator)
+{
+	for (int i = 0; i < BUDDY_CACHE_ORDERS; i++) {
+		if (allocator->cache_depth[i] > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline struct buddy_magazine_t* buddy_cache_magazine(struct buddy_allocator_t *allocator,
+		int order)
+{
+	struct buddy_thread_cache_t *cache;
+
+	if (order >= BUDDY_CACHE_ORDERS || allocator->cache_depth[order] == 0) {
+		return NULL;
+	}
+	cache = buddy_thread_cache(allocator);
+
+	return (cache != NULL) ? &cache->mag[order] : NULL;
+}
+
+static inline uint64_t buddy_lf_head(uint64_t old, uint32_t index)
+{
+	return (((old >> 32) + 1) << 32) | index;
+}
+
+static struct buddy_entry_t* buddy_lf_pop(struct buddy_allocator_t *allocator,
+		struct buddy_lf_stack_t *stack)
+{
+	uint64_t old = __atomic_load_n(&stack->head, __ATOMIC_ACQUIRE);
+	struct buddy_entry_t *entry;
+
+	do {
+		entry = buddy_entry_at(allocator, (uint32_t)old);
+		if (entry == NULL) {
+			__atomic_fetch_add(&stack->pop_misses, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		/*
+		 * entry may be popped and reused under us, but entries are
+		 * never unmapped and the tag makes the CAS below fail then.
+		 */
+	} while (!__atomic_compare_exchange_n(&stack->head, &old,
+				buddy_lf_head(old, __atomic_load_n(&entry->stack_next,
+						__ATOMIC_RELAXED)),
+				true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	__atomic_fetch_sub(&stack->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stack->pop_hits, 1, __ATOMIC_RELAXED);
+
+	return entry;
+}
+
+static bool buddy_lf_push(struct buddy_lf_stack_t *stack, int depth,
+		struct buddy_entry_t *entry)
+{
+	uint64_t old;
+
+	if (__atomic_fetch_add(&stack->count, 1, __ATOMIC_RELAXED) >= depth) {
+		__atomic_fetch_sub(&stack->count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stack->push_overflows, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	old = __atomic_load_n(&stack->head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&entry->stack_next, (uint32_t)old, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&stack->head, &old,
+				buddy_lf_head(old, entry->index),
+				true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&stack->push_hits, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/*
+ * Split a block of @order + 1 into two free halves. Caller holds the lock
+ * of @order; the block comes off the lists above like any allocation.
+ */
+static bool buddy_reserve_split(struct buddy_allocator_t *allocator, int order)
+{
+	struct buddy_entry_t *halves[2];
+	struct buddy_entry_t *entry;
+
+	if (order >= buddy_max_order(allocator) ||
+			buddy_pool_reserve(&allocator->entry_pool, halves, 2) != 0) {
+		return false;
+	}
+	buddy_lock_order(allocator, order + 1);
+	entry = buddy_alloc_shared(allocator, order + 1);
+	buddy_unlock_order(allocator, order + 1);
+	if (entry == NULL) {
+		buddy_pool_put(&allocator->entry_pool, halves[0]);
+		buddy_pool_put(&allocator->entry_pool, halves[1]);
+		return false;
+	}
+	buddy_split_entry(allocator, entry, halves);
+	buddy_stat_split(allocator, order, 1);
+
+	return true;
+}
+
+/* top every reserve order back up to reserve_blocks free blocks */
+static void buddy_coalescer_refill(struct buddy_allocator_t *allocator)
+{
+	if (allocator->backend != BUDDY_BACKEND_LIST) {
+		return;
+	}
+	for (int order = 0; order < buddy_max_order(allocator); order++) {
+		if (!(allocator->reserve_orders & (1ULL << order))) {
+			continue;
+		}
+		buddy_lock_order(allocator, order);
+		while (allocator->buddy_list[order].free_count < allocator->reserve_blocks &&
+				buddy_reserve_split(allocator, order)) {
+			__atomic_fetch_add(&allocator->coalescer->refills, 1, __ATOMIC_RELAXED);
+		}
+		buddy_unlock_order(allocator, order);
+	}
+}
+
+/* pairs with the worker publishing sleeping before it rechecks its work */
+static void buddy_coalescer_wake(struct buddy_coalescer_t *coalescer)
+{
+	if (__atomic_load_n(&coalescer->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&coalescer->wait_lock);
+		pthread_cond_signal(&coalescer->wake);
+		pthread_mutex_unlock(&coalescer->wait_lock);
+	}
+}
+
+static void buddy_coalescer_push(struct buddy_coalescer_t *coalescer,
+		struct buddy_entry_t *entry)
+{
+	uint32_t old = __atomic_load_n(&coalescer->head, __ATOMIC_RELAXED);
+
+	do {
+		__atomic_store_n(&entry->stack_next, old, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&coalescer->head, &old, entry->index,
+				true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&coalescer->deferred, 1, __ATOMIC_RELAXED);
+	buddy_coalescer_wake(coalescer);
+}
+
+/* ask the worker to top the reserve up after an allocation drew on it */
+static void buddy_coalescer_kick(struct buddy_allocator_t *allocator, int order)
+{
+	struct buddy_coalescer_t *coalescer = allocator->coalescer;
+
+	if (coalescer == NULL || !(allocator->reserve_orders & (1ULL << order)) ||
+			__atomic_load_n(&coalescer->refill, __ATOMIC_RELAXED)) {
+		return;
+	}
+	__atomic_store_n(&coalescer->refill, true, __ATOMIC_SEQ_CST);
+	buddy_coalescer_wake(coalescer);
+}
+
+/*
+ * Free every queued block into the shared lists, keeping the order lock
+ * across runs of blocks of the same order, then top the reserve up if
+ * @refill and anything may have drawn on it. Returns the blocks freed.
+ */
+static int buddy_coalescer_flush(struct buddy_allocator_t *allocator, bool refill)
+{
+	struct buddy_coalescer_t *coalescer = allocator->coalescer;
+	uint32_t index;
+	int locked = -1;
+	int count = 0;
+
+	if (coalescer == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&coalescer->consume_lock);
+	index = __atomic_exchange_n(&coalescer->head, BUDDY_NIL, __ATOMIC_ACQUIRE);
+	while (index != BUDDY_NIL) {
+		struct buddy_entry_t *entry = buddy_entry_at(allocator, index);
+
+		index = __atomic_load_n(&entry->stack_next, __ATOMIC_RELAXED);
+		if (entry->order != locked) {
+			if (locked >= 0) {
+				buddy_unlock_order(allocator, locked);
+			}
+			locked = entry->order;
+			buddy_lock_order(allocator, locked);
+		}
+		buddy_free_shared(allocator, entry);
+		count++;
+	}
+	if (locked >= 0) {
+		buddy_unlock_order(allocator, locked);
+	}
+	if (count > 0) {
+		__atomic_fetch_add(&coalescer->batches, 1, __ATOMIC_RELAXED);
+	}
+	if (refill && allocator->reserve_blocks > 0 &&
+			(__atomic_exchange_n(&coalescer->refill, false, __ATOMIC_SEQ_CST) ||
+			 count > 0)) {
+		buddy_coalescer_refill(allocator);
+	}
+	pthread_mutex_unlock(&coalescer->consume_lock);
+	if (count > 0) {
+		buddy_pressure_check(allocator);
+	}
+
+	return count;
+}
+
+static void* buddy_coalescer_worker(void *arg)
+{
+	struct buddy_allocator_t *allocator = (struct buddy_allocator_t *)arg;
+	struct buddy_coalescer_t *coalescer = allocator->coalescer;
+
+	while (!__atomic_load_n(&coalescer->stop, __ATOMIC_ACQUIRE)) {
+		buddy_coalescer_flush(allocator, true);
+		pthread_mutex_lock(&coalescer->wait_lock);
+		__atomic_store_n(&coalescer->sleeping, true, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&coalescer->head, __ATOMIC_SEQ_CST) == BUDDY_NIL &&
+				!__atomic_load_n(&coalescer->refill, __ATOMIC_SEQ_CST) &&
+				!__atomic_load_n(&coalescer->stop, __ATOMIC_ACQUIRE)) {
+			pthread_cond_wait(&coalescer->wake, &coalescer->wait_lock);
+			__atomic_fetch_add(&coalescer->wakeups, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&coalescer->sleeping, false, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&coalescer->wait_lock);
+	}
+
+	return NULL;
+}
+
+static int buddy_coalescer_start(struct buddy_allocator_t *allocator)
+{
+	struct buddy_coalescer_t *coalescer;
+
+	coalescer = (struct buddy_coalescer_t *)calloc(1, sizeof(*coalescer));
+	if (coalescer == NULL) {
+		return -1;
+	}
+	coalescer->head = BUDDY_NIL;
+	pthread_mutex_init(&coalescer->consume_lock, NULL);
+	pthread_mutex_init(&coalescer->wait_lock, NULL);
+	pthread_cond_init(&coalescer->wake, NULL);
+	allocator->coalescer = coalescer;
+	if (pthread_create(&coalescer->thread, NULL, buddy_coalescer_worker, allocator) != 0) {
+		allocator->coalescer = NULL;
+		pthread_cond_destroy(&coalescer->wake);
+		pthread_mutex_destroy(&coalescer->wait_lock);
+		pthread_mutex_destroy(&coalescer->consume_lock);
+		free(coalescer);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* join the worker and free whatever it left queued */
+static void buddy_coalescer_stop(struct buddy_allocator_t *allocator)
+{
+	struct buddy_coalescer_t *coalescer = allocator->coalescer;
+
+	if (coalescer == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&coalescer->wait_lock);
+	__atomic_store_n(&coalescer->stop, true, __ATOMIC_RELEASE);
+	pthread_cond_signal(&coalescer->wake);
+	pthread_mutex_unlock(&coalescer->wait_lock);
+	pthread_join(coalescer->thread, NULL);
+	buddy_coalescer_flush(allocator, false);
+	allocator->coalescer = NULL;
+	pthread_cond_destroy(&coalescer->wake);
+	pthread_mutex_destroy(&coalescer->wait_lock);
+	pthread_mutex_destroy(&coalescer->consume_lock);
+	free(coalescer);
+}
+
+/*
+ * Hand every parked block back to the shared lists so it can coalesce:
+ * buddy_lf_release() empties the lock-free and hot stacks and returns the
+ * blocks moved, buddy_lf_drain() also flushes the coalescer queue.
+ */
+static int buddy_lf_release(struct buddy_allocator_t *allocator)
+{
+	int released = 0;
+
+	for (int i = 0; i < allocator->lockfree_orders; i++) {
+		struct buddy_entry_t *entry;
+
+		buddy_lock_order(allocator, i);
+		while ((entry = buddy_lf_pop(allocator, &allocator->lf_stack[i])) != NULL) {
+			buddy_free_shared(allocator, entry);
+			released++;
+		}
+		buddy_unlock_order(allocator, i);
+	}
+	if (allocator->hot_reserve > 0) {
+		struct buddy_entry_t *entry;
+
+		buddy_lock_order(allocator, allocator->hot_order);
+		while ((entry = buddy_lf_pop(allocator, &allocator->hot.stack)) != NULL) {
+			buddy_free_shared(allocator, entry);
+			released++;
+		}
+		buddy_unlock_order(allocator, allocator->hot_order);
+	}
+
+	return released;
+}
+
+static void buddy_lf_drain(struct buddy_allocator_t *allocator)
+{
+	buddy_lf_release(allocator);
+	buddy_coalescer_flush(allocator, true);
+}
+
+static int buddy_slab_shrink(struct buddy_allocator_t *allocator);
+
+/*
+ * Pop a hot order block. On a miss take half a reserve from the lists
+ * under one lock: the first block goes to the caller, the rest is parked.
+ */
+static struct buddy_entry_t* buddy_hot_alloc(struct buddy_allocator_t *allocator)
+{
+	struct buddy_entry_t *batch[(BUDDY_HOT_DEPTH_MAX + 1) / 2];
+	struct buddy_hot_t *hot = &allocator->hot;
+	int order = allocator->hot_order;
+	struct buddy_entry_t *entry;
+	int count;
+
+	entry = buddy_lf_pop(allocator, &hot->stack);
+	if (entry != NULL) {
+		__atomic_fetch_add(&hot->hits, 1, __ATOMIC_RELAXED);
+		return entry;
+	}
+	__atomic_fetch_add(&hot->misses, 1, __ATOMIC_RELAXED);
+	buddy_lock_order(allocator, order);
+	count = buddy_alloc_shared_bulk(allocator, order, (allocator->hot_reserve + 1) / 2, batch);
+	for (int i = 1; i < count; i++) {
+		if (!buddy_lf_push(&hot->stack, allocator->hot_reserve, batch[i])) {
+			buddy_free_shared(allocator, batch[i]);
+		}
+	}
+	buddy_unlock_order(allocator, order);
+	if (count == 0) {
+		return NULL;
+	}
+	__atomic_fetch_add(&hot->refills, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hot->refill_blocks, count, __ATOMIC_RELAXED);
+
+	return batch[0];
+}
+
+static int buddy_shrink_coalescer(struct buddy_allocator_t *allocator, int order, void *data)
+{
+	(void)order;
+	(void)data;
+
+	return buddy_coalescer_flush(allocator, false);
+}
+
+/*
+ * Only the calling thread's magazines: their owners pop and push without
+ * any lock, so another thread's cache cannot be emptied from here. Blocks
+ * parked by other threads come back when those threads flush or exit.
+ * The lock-free and hot stacks are shared and are drained as well.
+ */
+static int buddy_shrink_thread_cache(struct buddy_allocator_t *allocator, int order, void *data)
+{
+	struct buddy_thread_cache_t *cache;
+	int released = 0;
+
+	(void)order;
+	(void)data;
+	cache = (struct buddy_thread_cache_t *)pthread_getspecific(allocator->cache_key);
+	if (cache != NULL) {
+		released = buddy_cache_empty(cache);
+	}
+
+	return released + buddy_lf_release(allocator);
+}
+
+static int buddy_shrink_slab(struct buddy_allocator_t *allocator, int order, void *data)
+{
+	(void)order;
+	(void)data;
+
+	return buddy_slab_shrink(allocator);
+}
+
+static int buddy_shrink_compact(struct buddy_allocator_t *allocator, int order, void *data)
+{
+	(void)order;
+	(void)data;
+	/* without deferred merges the lists are already coalesced */
+	return buddy_defers_merges(allocator) ? buddy_compact(allocator) : 0;
+}
+
+/* link @shrinker in after every shrinker of the same or lower cost */
+static void buddy_register_shrinker(struct buddy_allocator_t *allocator,
+		struct buddy_shrinker_t *shrinker)
+{
+	struct buddy_shrinker_t *pos;
+
+	pthread_mutex_lock(&allocator->shrinker_lock);
+	list_for_each_entry(pos, &allocator->shrinkers, link) {
+		if (pos->cost > shrinker->cost) {
+			break;
+		}
+	}
+	list_add_tail(&shrinker->link, &pos->link);
+	pthread_mutex_unlock(&allocator->shrinker_lock);
+}
+
+static void buddy_unregister_shrinker(struct buddy_allocator_t *allocator,
+		struct buddy_shrinker_t *shrinker)
+{
+	pthread_mutex_lock(&allocator->shrinker_lock);
+	list_del(&shrinker->link);
+	pthread_mutex_unlock(&allocator->shrinker_lock);
+}
+
+static void buddy_shrinker_init(struct buddy_allocator_t *allocator)
+{
+	static const struct buddy_shrinker_t builtin[BUDDY_SHRINKERS_BUILTIN] = {
+		{ .name = "coalescer", .cost = BUDDY_SHRINK_COST_COALESCER,
+			.shrink = buddy_shrink_coalescer },
+		{ .name = "thread-cache", .cost = BUDDY_SHRINK_COST_CACHES,
+			.shrink = buddy_shrink_thread_cache },
+		{ .name = "slab", .cost = BUDDY_SHRINK_COST_SLAB,
+			.shrink = buddy_shrink_slab },
+		{ .name = "compact", .cost = BUDDY_SHRINK_COST_COMPACT,
+			.shrink = buddy_shrink_compact },
+	};
+
+	INIT_LIST_HEAD(&allocator->shrinkers);
+	pthread_mutex_init(&allocator->shrinker_lock, NULL);
+	for (int i = 0; i < BUDDY_SHRINKERS_BUILTIN; i++) {
+		allocator->builtin_shrinkers[i] = builtin[i];
+		buddy_register_shrinker(allocator, &allocator->builtin_shrinkers[i]);
+	}
+}
+
+static void buddy_shrinker_destroy(struct buddy_allocator_t *allocator)
+{
+	while (!list_empty(&allocator->shrinkers)) {
+		buddy_unregister_shrinker(allocator, list_first_entry(&allocator->shrinkers,
+					struct buddy_shrinker_t, link));
+	}
+	pthread_mutex_destroy(&allocator->shrinker_lock);
+}
+
+/*
+ * Run the shrinkers below @max_cost in cost order. With @order >= 0 stop
+ * at the first one after which a block of @order can be allocated.
+ */
+static struct buddy_entry_t* buddy_shrink(struct buddy_allocator_t *allocator,
+		int order, int max_cost)
+{
+	struct buddy_shrinker_t *shrinker;
+	struct buddy_entry_t *entry = NULL;
+
+	list_for_each_entry(shrinker, &allocator->shrinkers, link) {
+		int released;
+
+		if (shrinker->cost >= max_cost) {
+			break;
+		}
+		released = shrinker->shrink(allocator, order, shrinker->data);
+		shrinker->calls++;
+		if (released <= 0) {
+			continue;
+		}
+		shrinker->reclaimed += released;
+		if (order >= 0) {
+			buddy_lock_order(allocator, order);
+			entry = buddy_alloc_shared(allocator, order);
+			buddy_unlock_order(allocator, order);
+			if (entry != NULL) {
+				break;
+			}
+		}
+	}
+
+	return entry;
+}
+
+/* last resort before an allocation of @order fails */
+static struct buddy_entry_t* buddy_reclaim(struct buddy_allocator_t *allocator, int order)
+{
+	struct buddy_entry_t *entry;
+
+	pthread_mutex_lock(&allocator->shrinker_lock);
+	entry = buddy_shrink(allocator, order, INT_MAX);
+	pthread_mutex_unlock(&allocator->shrinker_lock);
+
+	return entry;
+}
+
+/*
+ * Edge-triggered watermark check after an alloc or free. The thread that
+ * takes free memory under the low watermark shrinks the caches then, so
+ * the one that later finds the lists empty has less left to do.
+ */
+static void buddy_pressure_check(struct buddy_allocator_t *allocator)
+{
+	uint64_t free_pages;
+	bool pressure;
+	bool current;
+
+	if (allocator->low_watermark == 0) {
+		return;
+	}
+	free_pages = __atomic_load_n(&allocator->free_pages, __ATOMIC_RELAXED);
+	if (free_pages < allocator->low_watermark) {
+		pressure = true;
+	} else if (free_pages >= allocator->high_watermark) {
+		pressure = false;
+	} else {
+		return;
+	}
+	current = !pressure;
+	if (__atomic_load_n(&allocator->under_pressure, __ATOMIC_RELAXED) == pressure ||
+			!__atomic_compare_exchange_n(&allocator->under_pressure, &current,
+				pressure, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return;
+	}
+	if (pressure) {
+		__atomic_fetch_add(&allocator->pressure_events, 1, __ATOMIC_RELAXED);
+		if (pthread_mutex_trylock(&allocator->shrinker_lock) == 0) {
+			buddy_shrink(allocator, -1, BUDDY_SHRINK_COST_AHEAD);
+			pthread_mutex_unlock(&allocator->shrinker_lock);
+		}
+	}
+	if (allocator->pressure_notify != NULL) {
+		allocator->pressure_notify(allocator, pressure ? BUDDY_PRESSURE_LOW :
+				BUDDY_PRESSURE_HIGH, allocator->pressure_data);
+	}
+}
+
+/* one block of @page_order from the magazine, lock-free stack or lists */
+static struct buddy_entry_t* buddy_alloc_order(struct buddy_allocator_t *allocator,
+		int page_order)
+{
+	struct buddy_magazine_t *mag = buddy_cache_magazine(allocator, page_order);
+	struct buddy_entry_t *entry;
+
+	if (mag != NULL) {
+		entry = buddy_cache_alloc(allocator, mag, page_order);
+	} else {
+		entry = NULL;
+		if (page_order < allocator->lockfree_orders) {
+			entry = buddy_lf_pop(allocator, &allocator->lf_stack[page_order]);
+		}
+		if (entry == NULL) {
+			buddy_lock_order(allocator, page_order);
+			entry = buddy_alloc_shared(allocator, page_order);
+			buddy_unlock_order(allocator, page_order);
+		}
+	}
+	if (entry == NULL) {
+		entry = buddy_reclaim(allocator, page_order);
+	}
+	if (entry != NULL) {
+		buddy_coalescer_kick(allocator, page_order);
+	}
+	buddy_pressure_check(allocator);
+
+	return entry;
+}
+
+static void buddy_alloc_account(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry, int page_order, uint64_t size)
+{
+	buddy_stat_alloc(allocator, page_order, entry != NULL, entry == NULL);
+	if (entry == NULL) {
+		return;
+	}
+	__atomic_fetch_add(&allocator->bytes_requested, size, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&allocator->bytes_allocated,
+			(unsigned long long)buddy_page_size(allocator) << page_order,
+			__ATOMIC_RELAXED);
+	if (allocator->block_map != NULL) {
+		allocator->block_map[buddy_frame_index(allocator, entry->start_addr)] = entry;
+	}
+	if (allocator->trace != NULL) {
+		buddy_trace_record(allocator->trace, BUDDY_TRACE_ALLOC, size,
+				buddy_trace_id(allocator, entry->index));
+	}
+}
+
+static inline bool buddy_hot_fits(struct buddy_allocator_t *allocator, uint64_t size)
+{
+	return allocator->hot_reserve > 0 && size - allocator->hot.min_size <=
+		allocator->hot.max_size - allocator->hot.min_size;
+}
+
+static struct buddy_entry_t* buddy_alloc(struct buddy_allocator_t *allocator, uint64_t size)
+{
+	int page_order;
+	struct buddy_entry_t *entry;
+
+	if (buddy_hot_fits(allocator, size)) {
+		entry = buddy_hot_alloc(allocator);
+		if (entry != NULL) {
+			buddy_alloc_account(allocator, entry, allocator->hot_order, size);
+			return entry;
+		}
+	}
+	page_order = buddy_size_to_order(allocator, size);
+	if (page_order > buddy_max_order(allocator)) {
+		return NULL;
+	}
+	entry = buddy_alloc_order(allocator, page_order);
+	buddy_alloc_account(allocator, entry, page_order, size);
+
+	return entry;
+}
+
+/* park a block in the hot reserve, magazine, lock-free stack or coalescer */
+static bool buddy_release_front(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry)
+{
+	int order = entry->order;
+	struct buddy_magazine_t *mag;
+
+	if (order == allocator->hot_order && allocator->hot_reserve > 0 &&
+			buddy_lf_push(&allocator->hot.stack, allocator->hot_reserve, entry)) {
+		return true;
+	}
+	mag = buddy_cache_magazine(allocator, order);
+	if (mag != NULL) {
+		buddy_cache_free(allocator, mag, entry);
+		return true;
+	}
+	if (order < allocator->lockfree_orders &&
+			buddy_lf_push(&allocator->lf_stack[order], allocator->lockfree_depth, entry)) {
+		return true;
+	}
+	if (allocator->coalescer != NULL) {
+		buddy_coalescer_push(allocator->coalescer, entry);
+		return true;
+	}
+
+	return false;
+}
+
+/* hand a block back to the front ends above, or else the lists */
+static void buddy_release(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry)
+{
+	int order = entry->order;
+
+	if (buddy_release_front(allocator, entry)) {
+		return;
+	}
+	buddy_lock_order(allocator, order);
+	buddy_free_shared(allocator, entry);
+	buddy_unlock_order(allocator, order);
+	buddy_pressure_check(allocator);
+}
+
+static void buddy_free_account(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	buddy_stat_free(allocator, entry->order);
+	if (allocator->block_map != NULL) {
+		allocator->block_map[buddy_frame_index(allocator, entry->start_addr)] = NULL;
+	}
+	/* before the free, so the id cannot show up in a new alloc first */
+	if (allocator->trace != NULL) {
+		buddy_trace_record(allocator->trace, BUDDY_TRACE_FREE, 0,
+				buddy_trace_id(allocator, entry->index));
+	}
+}
+
+static void buddy_free(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry)
+{
+	buddy_free_account(allocator, entry);
+	buddy_release(allocator, entry);
+}
+
+/*
+ * Allocate up to @nr blocks of @size bytes into @out, each one served as
+ * buddy_alloc() would. Without a hot reserve, magazine or lock-free stack
+ * in front of the order, the lists are taken once for the whole batch and
+ * only the shortfall goes through the shrinkers. Returns how many were
+ * allocated.
+ */
+static int buddy_alloc_bulk(struct buddy_allocator_t *allocator, uint64_t size, int nr,
+		struct buddy_entry_t **out)
+{
+	int order = buddy_size_to_order(allocator, size);
+	int count = 0;
+
+	if (order > buddy_max_order(allocator) || nr <= 0) {
+		return 0;
+	}
+	for (; count < nr && buddy_hot_fits(allocator, size); count++) {
+		out[count] = buddy_hot_alloc(allocator);
+		if (out[count] == NULL) {
+			break;
+		}
+		buddy_alloc_account(allocator, out[count], allocator->hot_order, size);
+	}
+	if (buddy_cache_magazine(allocator, order) != NULL || order < allocator->lockfree_orders) {
+		for (; count < nr; count++) {
+			out[count] = buddy_alloc_order(allocator, order);
+			if (out[count] == NULL) {
+				break;
+			}
+			buddy_alloc_account(allocator, out[count], order, size);
+		}
+		buddy_stat_alloc(allocator, order, 0, nr - count);
+		return count;
+	}
+	if (count < nr) {
+		int got;
+
+		buddy_lock_order(allocator, order);
+		got = buddy_alloc_shared_bulk(allocator, order, nr - count, &out[count]);
+		buddy_unlock_order(allocator, order);
+		while (count + got < nr &&
+				(out[count + got] = buddy_reclaim(allocator, order)) != NULL) {
+			got++;
+		}
+		if (got > 0) {
+			buddy_coalescer_kick(allocator, order);
+		}
+		buddy_pressure_check(allocator);
+		for (int i = 0; i < got; i++) {
+			buddy_alloc_account(allocator, out[count + i], order, size);
+		}
+		count += got;
+		buddy_stat_alloc(allocator, order, 0, nr - count);
+	}
+
+	return count;
+}
+
+static int buddy_entry_cmp(const void *a, const void *b)
+{
+	const struct buddy_entry_t *x = *(struct buddy_entry_t * const *)a;
+	const struct buddy_entry_t *y = *(struct buddy_entry_t * const *)b;
+
+	if (x->order != y->order) {
+		return x->order - y->order;
+	}
+
+	return (x->start_addr > y->start_addr) - (x->start_addr < y->start_addr);
+}
+
+/*
+ * Free @nr blocks, each one as buddy_free() would. What the hot reserve,
+ * magazines, lock-free stacks or coalescer do not take is left in
+ * @entries, sorted by order and address so that buddies are freed back
+ * to back and each order's lock is taken once. @entries is clobbered.
+ */
+static void buddy_free_bulk(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t **entries, int nr)
+{
+	int i = 0, left = 0;
+
+	for (int j = 0; j < nr; j++) {
+		buddy_free_account(allocator, entries[j]);
+		if (!buddy_release_front(allocator, entries[j])) {
+			entries[left++] = entries[j];
+		}
+	}
+	if (left == 0) {
+		return;
+	}
+	qsort(entries, left, sizeof(*entries), buddy_entry_cmp);
+	while (i < left) {
+		int order = entries[i]->order;
+
+		buddy_lock_order(allocator, order);
+		for (; i < left && entries[i]->order == order; i++) {
+			buddy_free_shared(allocator, entries[i]);
+		}
+		buddy_unlock_order(allocator, order);
+	}
+	buddy_pressure_check(allocator);
+}
+
+static inline void* buddy_entry_ptr(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	if (allocator->base == NULL) {
+		return NULL;
+	}
+
+	return (char *)allocator->base + (entry->start_addr - allocator->start_addr);
+}
+
+/*
+ * Pointer to the entry of the block allocated at @ptr, or NULL when @ptr
+ * is not the start of a live block of this allocator.
+ */
+static struct buddy_entry_t* buddy_ptr_to_entry(struct buddy_allocator_t *allocator,
+		void *ptr)
+{
+	uintptr_t offset = (uintptr_t)ptr - (uintptr_t)allocator->base;
+	uint64_t index = offset >> buddy_shift(allocator);
+	struct buddy_entry_t *entry;
+
+	if (allocator->base == NULL || (uintptr_t)ptr < (uintptr_t)allocator->base ||
+			offset >= allocator->region_size ||
+			(offset & (buddy_page_size(allocator) - 1)) != 0) {
+		return NULL;
+	}
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		entry = &allocator->frames[index];
+		return (entry->is_used &&
+				entry->start_addr == allocator->start_addr + offset) ? entry : NULL;
+	}
+
+	return allocator->block_map[index];
+}
+
+static void* buddy_alloc_ptr(struct buddy_allocator_t *allocator, uint64_t size)
+{
+	struct buddy_entry_t *entry;
+
+	if (allocator->base == NULL) {
+		return NULL;
+	}
+	entry = buddy_alloc(allocator, size);
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	return buddy_entry_ptr(allocator, entry);
+}
+
+static void buddy_free_ptr(struct buddy_allocator_t *allocator, void *ptr)
+{
+	struct buddy_entry_t *entry = buddy_ptr_to_entry(allocator, ptr);
+
+	if (entry == NULL) {
+		msg_err("free of unknown pointer %p", ptr);
+		return;
+	}
+	buddy_free(allocator, entry);
+}
+
+/*
+ * Block handles: the block's index within its order above a 6 bit order,
+ * i.e. ((page offset >> order) << 6) | order. A handle fits in 32 bits
+ * while max_order <= 26, and the buddy of a block is its handle with the
+ * lowest index bit flipped. The bitmap backend finds the descriptor of a
+ * handle in its frame table, the list backend needs the block map, so
+ * set buddy_allocator_t::handles before init when using it.
+ */
+typedef uint64_t buddy_handle_t;
+
+#define BUDDY_HANDLE_ORDER_BITS	6
+#define BUDDY_HANDLE_NONE	UINT64_MAX
+
+static inline int buddy_handle_order(buddy_handle_t handle)
+{
+	return handle & ((1 << BUDDY_HANDLE_ORDER_BITS) - 1);
+}
+
+static inline uint64_t buddy_handle_page(buddy_handle_t handle)
+{
+	return (handle >> BUDDY_HANDLE_ORDER_BITS) << buddy_handle_order(handle);
+}
+
+static inline uint64_t buddy_handle_addr(struct buddy_allocator_t *allocator,
+		buddy_handle_t handle)
+{
+	return allocator->start_addr + (buddy_handle_page(handle) << buddy_shift(allocator));
+}
+
+static inline buddy_handle_t buddy_handle_buddy(buddy_handle_t handle)
+{
+	return handle ^ (1ULL << BUDDY_HANDLE_ORDER_BITS);
+}
+
+static inline buddy_handle_t buddy_entry_handle(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry)
+{
+	return ((buddy_frame_index(allocator, entry->start_addr) >> entry->order) <<
+			BUDDY_HANDLE_ORDER_BITS) | entry->order;
+}
+
+/* descriptor of an allocated block, NULL if the handle names none */
+static struct buddy_entry_t* buddy_handle_entry(struct buddy_allocator_t *allocator,
+		buddy_handle_t handle)
+{
+	uint64_t page = buddy_handle_page(handle);
+	struct buddy_entry_t *entry;
+
+	if (handle == BUDDY_HANDLE_NONE || buddy_handle_order(handle) > buddy_max_order(allocator) ||
+			page >= (1ULL << buddy_max_order(allocator))) {
+		return NULL;
+	}
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		entry = &allocator->frames[page];
+	} else if (allocator->block_map != NULL) {
+		entry = allocator->block_map[page];
+	} else {
+		return NULL;
+	}
+	if (entry == NULL || !entry->is_used || entry->order != buddy_handle_order(handle) ||
+			buddy_frame_index(allocator, entry->start_addr) != page) {
+		return NULL;
+	}
+
+	return entry;
+}
+
+static buddy_handle_t buddy_alloc_handle(struct buddy_allocator_t *allocator, uint64_t size)
+{
+	struct buddy_entry_t *entry;
+
+	if (allocator->backend == BUDDY_BACKEND_LIST && allocator->block_map == NULL) {
+		return BUDDY_HANDLE_NONE;
+	}
+	entry = buddy_alloc(allocator, size);
+
+	return (entry != NULL) ? buddy_entry_handle(allocator, entry) : BUDDY_HANDLE_NONE;
+}
+
+static void buddy_free_handle(struct buddy_allocator_t *allocator, buddy_handle_t handle)
+{
+	struct buddy_entry_t *entry = buddy_handle_entry(allocator, handle);
+
+	if (entry == NULL) {
+		msg_err("free of unknown handle 0x%" PRIx64, handle);
+		return;
+	}
+	buddy_free(allocator, entry);
+}
+
+static inline void* buddy_handle_ptr(struct buddy_allocator_t *allocator,
+		buddy_handle_t handle)
+{
+	if (allocator->base == NULL || handle == BUDDY_HANDLE_NONE) {
+		return NULL;
+	}
+
+	return (char *)allocator->base + (buddy_handle_page(handle) << buddy_shift(allocator));
+}
+
+/*
+ * Order of a block of @size bytes that is also aligned to @align bytes,
+ * or -1. Blocks are aligned to their size relative to start_addr, so an
+ * alignment beyond a page only holds if start_addr has it as well.
+ */
+static int buddy_aligned_order(struct buddy_allocator_t *allocator, uint64_t size,
+		uint64_t align)
+{
+	int order = buddy_size_to_order(allocator, size);
+
+	if (align == 0 || (align & (align - 1)) != 0 ||
+			(allocator->start_addr & (align - 1)) != 0) {
+		return -1;
+	}
+	if (align > (uint64_t)buddy_page_size(allocator)) {
+		int align_order = __builtin_ctzll(align) - buddy_shift(allocator);
+
+		if (align_order > order) {
+			order = align_order;
+		}
+	}
+
+	return (order <= buddy_max_order(allocator)) ? order : -1;
+}
+
+static struct buddy_entry_t* buddy_alloc_aligned(struct buddy_allocator_t *allocator,
+		uint64_t size, uint64_t align)
+{
+	int order = buddy_aligned_order(allocator, size, align);
+	struct buddy_entry_t *entry;
+
+	if (order < 0) {
+		return NULL;
+	}
+	entry = buddy_alloc_order(allocator, order);
+	buddy_alloc_account(allocator, entry, order, size);
+
+	return entry;
+}
+
+/*
+ * Split an allocated block into two allocated halves. The list backend
+ * keeps the block as their parent, built from the two @reserved entries;
+ * the bitmap backend relabels the frames. Returns the upper half.
+ */
+static struct buddy_entry_t* buddy_split_used(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry, struct buddy_entry_t **reserved,
+		struct buddy_entry_t **lower)
+{
+	int order = entry->order - 1;
+	struct buddy_entry_t *upper;
+
+	buddy_lock_order(allocator, order);
+	buddy_lock_order(allocator, order + 1);
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		uint64_t addr = entry->start_addr + ((uint64_t)buddy_page_size(allocator) << order);
+
+		/* the block stays counted at order + 1 as the split parent */
+		buddy_unlink_entry(allocator, entry);
+		allocator->buddy_list[order].splits++;
+		entry->order = order;
+		buddy_link_used_entry(allocator, entry);
+		upper = &allocator->frames[buddy_frame_index(allocator, addr)];
+		upper->start_addr = addr;
+		upper->order = order;
+		upper->is_used = true;
+		buddy_link_used_entry(allocator, upper);
+		*lower = entry;
+	} else {
+		upper = buddy_split_entry(allocator, entry, reserved);
+		*lower = reserved[0];
+		buddy_remove_free_entry(allocator, *lower);
+		buddy_remove_free_entry(allocator, upper);
+	}
+	buddy_unlock_order(allocator, order + 1);
+	buddy_unlock_order(allocator, order);
+
+	return upper;
+}
+
+/*
+ * Cut an allocated block down to its first @pages pages. What is kept
+ * becomes a run of allocated blocks of decreasing order, one per bit set
+ * in @pages, and the tail is released as buddy_free() would.
+ */
+static int buddy_trim(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry,
+		uint64_t pages, struct buddy_entry_t **reserved, struct buddy_entry_t **pieces)
+{
+	int nr = 0;
+
+	while (pages < (1ULL << entry->order)) {
+		uint64_t half = 1ULL << (entry->order - 1);
+		struct buddy_entry_t *lower, *upper;
+
+		upper = buddy_split_used(allocator, entry, reserved, &lower);
+		reserved += 2;
+		if (pages <= half) {
+			buddy_release(allocator, upper);
+			entry = lower;
+		} else {
+			pieces[nr++] = lower;
+			pages -= half;
+			entry = upper;
+		}
+	}
+	pieces[nr++] = entry;
+
+	return nr;
+}
+
+/*
+ * A contiguous run of exactly the pages asked for, e.g. 12 pages out of
+ * a 16 page block with the last 4 returned at once. The run is made of
+ * ordinary blocks, so the list backend needs the block map (handles) to
+ * find them again in buddy_free_range(). A range is traced as a single
+ * block under the id of its first piece.
+ */
+struct buddy_range_t {
+	uint64_t start_addr;
+	uint64_t pages;
+};
+
+static int buddy_alloc_range(struct buddy_allocator_t *allocator, uint64_t size,
+		uint64_t align, struct buddy_range_t *range)
+{
+	struct buddy_entry_t *reserved[2 * BUDDY_MAX_ORDER];
+	struct buddy_entry_t *pieces[BUDDY_MAX_ORDER + 1];
+	int order = buddy_aligned_order(allocator, size, align);
+	uint64_t pages = (size >> buddy_shift(allocator)) +
+		((size & (buddy_page_size(allocator) - 1)) != 0);
+	struct buddy_entry_t *entry;
+	int nr_reserved = 0, nr;
+
+	if (order < 0 || size == 0 ||
+			(allocator->backend == BUDDY_BACKEND_LIST && allocator->block_map == NULL)) {
+		return -1;
+	}
+	/* every split on the way down to the lowest set bit of pages */
+	if (allocator->backend == BUDDY_BACKEND_LIST) {
+		nr_reserved = 2 * (order - __builtin_ctzll(pages));
+		if (buddy_pool_reserve(&allocator->entry_pool, reserved, nr_reserved) != 0) {
+			return -1;
+		}
+	}
+	entry = buddy_alloc_order(allocator, order);
+	buddy_stat_alloc(allocator, order, entry != NULL, entry == NULL);
+	if (entry == NULL) {
+		for (int i = 0; i < nr_reserved; i++) {
+			buddy_pool_put(&allocator->entry_pool, reserved[i]);
+		}
+		return -1;
+	}
+	range->start_addr = entry->start_addr;
+	range->pages = pages;
+	nr = buddy_trim(allocator, entry, pages, reserved, pieces);
+	for (int i = 0; allocator->block_map != NULL && i < nr; i++) {
+		allocator->block_map[buddy_frame_index(allocator, pieces[i]->start_addr)] = pieces[i];
+	}
+	if (allocator->trace != NULL) {
+		buddy_trace_record(allocator->trace, BUDDY_TRACE_ALLOC, size,
+				buddy_trace_id(allocator, pieces[0]->index));
+	}
+	__atomic_fetch_add(&allocator->bytes_requested, size, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&allocator->bytes_allocated,
+			(unsigned long long)pages << buddy_shift(allocator), __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static void buddy_free_range(struct buddy_allocator_t *allocator,
+		const struct buddy_range_t *range)
+{
+	uint64_t page = buddy_frame_index(allocator, range->start_addr);
+
+	for (int order = buddy_max_order(allocator); order >= 0; order--) {
+		struct buddy_entry_t *entry;
+
+		if (!(range->pages & (1ULL << order))) {
+			continue;
+		}
+		entry = buddy_handle_entry(allocator,
+				((page >> order) << BUDDY_HANDLE_ORDER_BITS) | order);
+		if (entry == NULL) {
+			msg_err("free of unknown range 0x%" PRIx64 "+%" PRIu64 " pages",
+					range->start_addr, range->pages);
+			return;
+		}
+		if (allocator->trace != NULL && entry->start_addr == range->start_addr) {
+			buddy_trace_record(allocator->trace, BUDDY_TRACE_FREE, 0,
+					buddy_trace_id(allocator, entry->index));
+		}
+		buddy_stat_free(allocator, order);
+		if (allocator->block_map != NULL) {
+			allocator->block_map[page] = NULL;
+		}
+		buddy_release(allocator, entry);
+		page += 1ULL << order;
+	}
+}
+
+/*
+ * Grow an allocated block to @order by absorbing its free upper buddies,
+ * or fail without touching anything. Every order on the way is locked
+ * up front so the check and the merge see the same lists. The list
+ * backend hands back the parent descriptor, which already covers the
+ * grown block.
+ */
+static struct buddy_entry_t* buddy_grow_in_place(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry, int order)
+{
+	uint64_t index = buddy_frame_index(allocator, entry->start_addr);
+	struct buddy_entry_t *cur = entry;
+	int base = entry->order;
+	bool possible = true;
+
+	for (int i = base; i <= order; i++) {
+		buddy_lock_order(allocator, i);
+	}
+	/* the block must be the lower half at every order it passes */
+	for (int i = base; possible && i < order; i++) {
+		if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+			possible = ((index >> i) & 1) == 0 &&
+				buddy_test_bit(allocator->pair_map[i], index >> (i + 1));
+		} else {
+			struct buddy_entry_t *buddy = buddy_entry_at(allocator, cur->buddy);
+
+			possible = buddy != NULL && !buddy->is_used &&
+				cur->start_addr < buddy->start_addr;
+			cur = buddy_entry_at(allocator, cur->parent);
+		}
+	}
+	for (int i = base; possible && i < order; i++) {
+		if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+			struct buddy_entry_t *buddy = &allocator->frames[index + (1ULL << i)];
+
+			buddy_test_and_change_bit(allocator->pair_map[i], index >> (i + 1));
+			buddy_free_list_del(allocator, buddy);
+			allocator->buddy_list[i].merges++;
+			/* the split parent becomes the grown block, relinked below */
+			allocator->buddy_list[i + 1].used_count--;
+		} else {
+			struct buddy_entry_t *parent = buddy_entry_at(allocator, entry->parent);
+
+			buddy_recycle_entry(allocator, entry);
+			entry = parent;
+		}
+	}
+	if (possible && allocator->backend == BUDDY_BACKEND_BITMAP) {
+		buddy_unlink_entry(allocator, entry);
+		allocator->buddy_list[base].used_count--;
+		entry->order = order;
+		buddy_link_used_entry(allocator, entry);
+	}
+	buddy_unlock_orders(allocator, base, order);
+	if (!possible) {
+		return NULL;
+	}
+	buddy_stat_merge(allocator, base, order - base);
+
+	return entry;
+}
+
+/*
+ * Resize an allocated block. Growing absorbs free upper buddies and
+ * shrinking gives the upper halves back, both without moving the data;
+ * only a grow that cannot be done in place allocates a new block and
+ * copies the old contents over. The descriptor may change either way.
+ * Returns NULL and leaves the old block alone on failure.
+ */
+static struct buddy_entry_t* buddy_realloc(struct buddy_allocator_t *allocator,
+		struct buddy_entry_t *entry, uint64_t size)
+{
+	struct buddy_entry_t *reserved[2 * BUDDY_MAX_ORDER];
+	int order = buddy_size_to_order(allocator, size);
+	struct buddy_entry_t *resized;
+	uint32_t old_index;
+	int old_order;
+
+	if (entry == NULL) {
+		return buddy_alloc(allocator, size);
+	}
+	if (order > buddy_max_order(allocator)) {
+		return NULL;
+	}
+	if (order == entry->order) {
+		return entry;
+	}
+	old_index = entry->index;
+	old_order = entry->order;
+	if (order > old_order) {
+		resized = buddy_grow_in_place(allocator, entry, order);
+		if (resized == NULL) {
+			resized = buddy_alloc(allocator, size);
+			if (resized == NULL) {
+				return NULL;
+			}
+			if (allocator->base != NULL) {
+				memcpy(buddy_entry_ptr(allocator, resized), buddy_entry_ptr(allocator, entry),
+						(size_t)buddy_page_size(allocator) << old_order);
+			}
+			buddy_free(allocator, entry);
+			return resized;
+		}
+	} else {
+		int nr_reserved = 0;
+
+		if (allocator->backend == BUDDY_BACKEND_LIST) {
+			nr_reserved = 2 * (old_order - order);
+			if (buddy_pool_reserve(&allocator->entry_pool, reserved, nr_reserved) != 0) {
+				return NULL;
+			}
+		}
+		/* a power of two number of pages is kept as a single block */
+		buddy_trim(allocator, entry, 1ULL << order, reserved, &resized);
+	}
+	/* account it as a free of the old block and an alloc of the new one */
+	buddy_stat_free(allocator, old_order);
+	if (allocator->trace != NULL) {
+		buddy_trace_record(allocator->trace, BUDDY_TRACE_FREE, 0,
+				buddy_trace_id(allocator, old_index));
+	}
+	buddy_alloc_account(allocator, resized, order, size);
+
+	return resized;
+}
+
+static void* buddy_realloc_ptr(struct buddy_allocator_t *allocator, void *ptr,
+		uint64_t size)
+{
+	struct buddy_entry_t *entry = NULL;
+
+	if (allocator->base == NULL) {
+		return NULL;
+	}
+	if (ptr != NULL) {
+		entry = buddy_ptr_to_entry(allocator, ptr);
+		if (entry == NULL) {
+			msg_err("realloc of unknown pointer %p", ptr);
+			return NULL;
+		}
+	}
+	entry = buddy_realloc(allocator, entry, size);
+
+	return (entry != NULL) ? buddy_entry_ptr(allocator, entry) : NULL;
+}
+
+static int buddy_slab_init(struct buddy_allocator_t *allocator)
+{
+	int shift = buddy_shift(allocator);
+	uint64_t slab_size;
+
+	if (allocator->base == NULL) {
+		return 0;
+	}
+	allocator->slab_order = (buddy_max_order(allocator) < BUDDY_SLAB_ORDER) ?
+		buddy_max_order(allocator) : BUDDY_SLAB_ORDER;
+	slab_size = (uint64_t)buddy_page_size(allocator) << allocator->slab_order;
+	/* classes of 16 bytes up to page_size / 8 */
+	allocator->nr_slab_classes = shift - 3 - BUDDY_SLAB_MIN_SHIFT + 1;
+	if (allocator->nr_slab_classes <= 0) {
+		allocator->nr_slab_classes = 0;
+		return 0;
+	}
+	allocator->slab_caches = (struct buddy_slab_cache_t *)calloc(
+			sizeof(struct buddy_slab_cache_t), allocator->nr_slab_classes);
+	if (allocator->slab_caches == NULL) {
+		return -1;
+	}
+	for (int i = 0; i < allocator->nr_slab_classes; i++) {
+		struct buddy_slab_cache_t *cache = &allocator->slab_caches[i];
+
+		cache->object_size = BUDDY_SLAB_MIN_OBJECT << i;
+		/* objects stay aligned to their size */
+		cache->offset = (sizeof(struct buddy_slab_t) + cache->object_size - 1) &
+			~(cache->object_size - 1);
+		cache->objects_per_slab = (slab_size - cache->offset) / cache->object_size;
+		INIT_LIST_HEAD(&cache->partial);
+		INIT_LIST_HEAD(&cache->full);
+		INIT_LIST_HEAD(&cache->empty);
+		pthread_mutex_init(&cache->lock, NULL);
+	}
+
+	return 0;
+}
+
+/* every slab goes back, whether or not its objects were freed */
+static void buddy_slab_destroy(struct buddy_allocator_t *allocator)
+{
+	for (int i = 0; allocator->slab_caches != NULL && i < allocator->nr_slab_classes; i++) {
+		struct buddy_slab_cache_t *cache = &allocator->slab_caches[i];
+		struct list_head_t *lists[] = { &cache->partial, &cache->full, &cache->empty };
+
+		for (int j = 0; j < 3; j++) {
+			struct buddy_slab_t *slab, *next;
+
+			list_for_each_entry_safe(slab, next, lists[j], link) {
+				buddy_free(allocator, slab->entry);
+			}
+		}
+		pthread_mutex_destroy(&cache->lock);
+	}
+	free(allocator->slab_caches);
+	allocator->slab_caches = NULL;
+	allocator->nr_slab_classes = 0;
+}
+
+/* called without the cache lock, the buddy allocation may shrink caches */
+static struct buddy_slab_t* buddy_slab_new(struct buddy_allocator_t *allocator,
+		struct buddy_slab_cache_t *cache)
+{
+	struct buddy_entry_t *entry;
+	struct buddy_slab_t *slab;
+	char *object;
+
+	entry = buddy_alloc(allocator,
+			(uint64_t)buddy_page_size(allocator) << allocator->slab_order);
+	if (entry == NULL) {
+		return NULL;
+	}
+	slab = (struct buddy_slab_t *)buddy_entry_ptr(allocator, entry);
+	slab->cache = cache;
+	slab->entry = entry;
+	slab->inuse = 0;
+	slab->free_objects = NULL;
+	/* chained from the top down so the lowest object goes out first */
+	object = (char *)slab + cache->offset +
+		(size_t)(cache->objects_per_slab - 1) * cache->object_size;
+	for (int i = 0; i < cache->objects_per_slab; i++) {
+		*(void **)object = slab->free_objects;
+		slab->free_objects = object;
+		object -= cache->object_size;
+	}
+
+	return slab;
+}
+
+static void* buddy_slab_alloc(struct buddy_allocator_t *allocator, uint64_t size)
+{
+	struct buddy_slab_cache_t *cache;
+	struct buddy_slab_t *slab;
+	void *object;
+	int class;
+
+	class = (size <= BUDDY_SLAB_MIN_OBJECT) ? 0 :
+		buddy_pages_to_order(size) - BUDDY_SLAB_MIN_SHIFT;
+	if (size == 0 || class >= allocator->nr_slab_classes) {
+		return NULL;
+	}
+	cache = &allocator->slab_caches[class];
+	pthread_mutex_lock(&cache->lock);
+	if (list_empty(&cache->partial)) {
+		if (!list_empty(&cache->empty)) {
+			list_move(cache->empty.next, &cache->partial);
+			cache->nr_empty--;
+		} else {
+			pthread_mutex_unlock(&cache->lock);
+			slab = buddy_slab_new(allocator, cache);
+			if (slab == NULL) {
+				return NULL;
+			}
+			pthread_mutex_lock(&cache->lock);
+			list_add(&slab->link, &cache->partial);
+			cache->nr_slabs++;
+		}
+	}
+	slab = list_first_entry(&cache->partial, struct buddy_slab_t, link);
+	object = slab->free_objects;
+	slab->free_objects = *(void **)object;
+	slab->inuse++;
+	cache->inuse++;
+	if (slab->free_objects == NULL) {
+		list_move(&slab->link, &cache->full);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return object;
+}
+
+static void buddy_slab_free(struct buddy_allocator_t *allocator, void *object)
+{
+	uintptr_t offset = (uintptr_t)object - (uintptr_t)allocator->base;
+	uintptr_t slab_size = (uintptr_t)buddy_page_size(allocator) << allocator->slab_order;
+	struct buddy_slab_cache_t *cache;
+	struct buddy_slab_t *slab;
+
+	if (allocator->slab_caches == NULL || (uintptr_t)object < (uintptr_t)allocator->base ||
+			offset >= allocator->region_size) {
+		msg_err("free of unknown object %p", object);
+		return;
+	}
+	slab = (struct buddy_slab_t *)((char *)allocator->base + (offset & ~(slab_size - 1)));
+	cache = slab->cache;
+	pthread_mutex_lock(&cache->lock);
+	*(void **)object = slab->free_objects;
+	slab->free_objects = object;
+	cache->inuse--;
+	if (--slab->inuse == 0) {
+		list_move(&slab->link, &cache->empty);
+		cache->nr_empty++;
+	} else if (slab->inuse == cache->objects_per_slab - 1) {
+		list_move(&slab->link, &cache->partial);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Hand the empty slabs back to the buddy lists, bypassing the magazines
+ * so a retried allocation can merge them. A cache busy on another thread
+ * is skipped rather than waited for: the caller may be that very thread
+ * growing the cache. Returns the number of slabs released.
+ */
+static int buddy_slab_shrink(struct buddy_allocator_t *allocator)
+{
+	int released = 0;
+
+	for (int i = 0; i < allocator->nr_slab_classes; i++) {
+		struct buddy_slab_cache_t *cache = &allocator->slab_caches[i];
+		struct buddy_slab_t *slab, *next;
+		LIST_HEAD(empty);
+
+		if (pthread_mutex_trylock(&cache->lock) != 0) {
+			continue;
+		}
+		list_splice_init(&cache->empty, &empty);
+		cache->nr_slabs -= cache->nr_empty;
+		cache->nr_empty = 0;
+		pthread_mutex_unlock(&cache->lock);
+		list_for_each_entry_safe(slab, next, &empty, link) {
+			struct buddy_entry_t *entry = slab->entry;
+			int order = entry->order;
+
+			buddy_free_account(allocator, entry);
+			buddy_lock_order(allocator, order);
+			buddy_free_shared(allocator, entry);
+			buddy_unlock_order(allocator, order);
+			released++;
+		}
+	}
+
+	return released;
+}
+
+/* first word of order @order in a snapshot bitmap, or their total for max_order + 1 */
+static inline size_t buddy_snapshot_offset(int max_order, int order)
+{
+	size_t offset = 0;
+
+	for (int i = 0; i < order; i++) {
+		offset += ((1ULL << (max_order - i)) + 63) / 64;
+	}
+
+	return offset;
+}
+
+static inline bool buddy_snapshot_test(const uint64_t *map, uint64_t nr)
+{
+	return (map[nr / 64] >> (nr % 64)) & 1;
+}
+
+static inline void buddy_snapshot_set(uint64_t *map, uint64_t nr)
+{
+	map[nr / 64] |= 1ULL << (nr % 64);
+}
+
+/* mark the allocated block @entry in the snapshot bitmap */
+static inline void buddy_snapshot_mark(struct buddy_allocator_t *allocator, uint64_t *map,
+		struct buddy_entry_t *entry, bool used)
+{
+	uint64_t nr = buddy_frame_index(allocator, entry->start_addr) >> entry->order;
+	uint64_t *words = map + buddy_snapshot_offset(buddy_max_order(allocator), entry->order);
+
+	if (used) {
+		buddy_snapshot_set(words, nr);
+	} else {
+		words[nr / 64] &= ~(1ULL << (nr % 64));
+	}
+}
+
+/*
+ * Write every allocated block of a quiescent allocator to @path. The
+ * caller's magazines and the lock-free stacks are flushed first so cached
+ * blocks are not taken for allocated ones. Other threads' magazines are
+ * theirs to pop without a lock: those threads must be quiescent and have
+ * called buddy_thread_cache_drain() or exited, or what they cache is
+ * recorded as allocated. Only block placement is saved, not contents,
+ * so slabs of the slab layer are left out: restore starts with empty slab
+ * caches that would own none of them, and they come back free.
+ */
+static int buddy_snapshot_save(struct buddy_allocator_t *allocator, const char *path)
+{
+	struct buddy_snapshot_header_t header = {
+		.magic = BUDDY_SNAPSHOT_MAGIC,
+		.version = BUDDY_SNAPSHOT_VERSION,
+		.page_size = buddy_page_size(allocator),
+		.max_order = buddy_max_order(allocator),
+		.start_addr = allocator->start_addr,
+	};
+	int max_order = buddy_max_order(allocator);
+	size_t nr_words = buddy_snapshot_offset(max_order, max_order + 1);
+	uint64_t *map;
+	FILE *file;
+	int ret = 0;
+
+	if (max_order > BUDDY_SNAPSHOT_MAX_ORDER) {
+		return -1;
+	}
+	map = (uint64_t *)calloc(sizeof(uint64_t), nr_words);
+	if (map == NULL) {
+		return -1;
+	}
+	buddy_thread_cache_drain(allocator);
+	buddy_lf_drain(allocator);
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		/* the head frame of every block knows its order */
+		for (uint64_t page = 0; page < 1ULL << max_order;
+				page += 1ULL << allocator->frames[page].order) {
+			if (allocator->frames[page].is_used) {
+				buddy_snapshot_mark(allocator, map, &allocator->frames[page], true);
+			}
+		}
+	} else {
+		struct buddy_entry_pool_t *pool = &allocator->entry_pool;
+
+		/* every used entry, then unmark those that are split parents */
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 0; i < pool->fresh; i++) {
+				struct buddy_entry_t *entry = &pool->entries[i];
+
+				if (entry->order == BUDDY_POOL_FREE) {
+					continue;
+				}
+				if (pass == 0 && entry->is_used) {
+					buddy_snapshot_mark(allocator, map, entry, true);
+				} else if (pass == 1 && entry->parent != BUDDY_NIL) {
+					buddy_snapshot_mark(allocator, map,
+							buddy_entry_at(allocator, entry->parent), false);
+				}
+			}
+		}
+	}
+	for (int i = 0; i < allocator->nr_slab_classes; i++) {
+		struct buddy_slab_cache_t *cache = &allocator->slab_caches[i];
+		struct list_head_t *lists[] = { &cache->partial, &cache->full, &cache->empty };
+
+		pthread_mutex_lock(&cache->lock);
+		for (int j = 0; j < 3; j++) {
+			struct buddy_slab_t *slab;
+
+			list_for_each_entry(slab, lists[j], link) {
+				buddy_snapshot_mark(allocator, map, slab->entry, false);
+			}
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+	for (size_t i = 0; i < nr_words; i++) {
+		header.nr_blocks += __builtin_popcountll(map[i]);
+	}
+	file = fopen(path, "wb");
+	if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1 ||
+			fwrite(map, sizeof(uint64_t), nr_words, file) != nr_words) {
+		ret = -1;
+	}
+	if (file != NULL && fclose(file) != 0) {
+		ret = -1;
+	}
+	free(map);
+
+	return ret;
+}
+
+struct buddy_snapshot_maps_t {
+	const uint64_t *used;
+	/* blocks with an allocated block below them, derived on restore */
+	uint64_t *split;
+	int max_order;
+};
+
+/* @entry is the free block at @page of @order, allocate or split it as recorded */
+static int buddy_snapshot_build(struct buddy_allocator_t *allocator,
+		const struct buddy_snapshot_maps_t *maps, struct buddy_entry_t *entry,
+		uint64_t page, int order)
+{
+	size_t offset = buddy_snapshot_offset(maps->max_order, order);
+	struct buddy_entry_t *halves[2];
+	uint64_t half;
+
+	if (buddy_snapshot_test(maps->used + offset, page >> order)) {
+		if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+			buddy_free_list_del(allocator, entry);
+			if (order < maps->max_order) {
+				buddy_test_and_change_bit(allocator->pair_map[order], page >> (order + 1));
+			}
+			entry->is_used = true;
+			buddy_link_used_entry(allocator, entry);
+		} else {
+			buddy_remove_free_entry(allocator, entry);
+		}
+		if (allocator->block_map != NULL) {
+			allocator->block_map[page] = entry;
+		}
+		return 0;
+	}
+	if (order == 0 || !buddy_snapshot_test(maps->split + offset, page >> order)) {
+		return 0;
+	}
+	half = 1ULL << (order - 1);
+	if (allocator->backend == BUDDY_BACKEND_BITMAP) {
+		buddy_free_list_del(allocator, entry);
+		if (order < maps->max_order) {
+			buddy_test_and_change_bit(allocator->pair_map[order], page >> (order + 1));
+		}
+		allocator->buddy_list[order - 1].splits++;
+		allocator->buddy_list[order].used_count++;
+		/* both halves free, their pair bit stays clear */
+		for (int i = 0; i < 2; i++) {
+			halves[i] = &allocator->frames[page + i * half];
+			halves[i]->start_addr = allocator->start_addr +
+				((page + i * half) << buddy_shift(allocator));
+			halves[i]->order = order - 1;
+			halves[i]->is_used = false;
+			buddy_free_list_add(allocator, halves[i]);
+		}
+	} else {
+		buddy_remove_free_entry(allocator, entry);
+		if (buddy_pool_reserve(&allocator->entry_pool, halves, 2) != 0) {
+			return -1;
+		}
+		buddy_split_entry(allocator, entry, halves);
+	}
+	if (buddy_snapshot_build(allocator, maps, halves[0], page, order - 1) != 0) {
+		return -1;
+	}
+
+	return buddy_snapshot_build(allocator, maps, halves[1], page + half, order - 1);
+}
+
+/*
+ * Initialize @allocator, configured as for buddy_allocator_init(), from
+ * the snapshot at @path: the blocks allocated when it was taken are
+ * allocated again and the rest is free and fully merged. The image is
+ * mapped rather than read, and only the orders above an allocated block
+ * are walked, so the cost follows the number of live blocks rather than
+ * the size of the region.
+ */
+static int buddy_snapshot_restore(struct buddy_allocator_t *allocator, const char *path)
+{
+	const struct buddy_snapshot_header_t *header;
+	struct buddy_snapshot_maps_t maps;
+	size_t nr_words;
+	struct stat st;
+	void *image;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+		close(fd);
+		return -1;
+	}
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		return -1;
+	}
+	header = (const struct buddy_snapshot_header_t *)image;
+	if (memcmp(header->magic, BUDDY_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != BUDDY_SNAPSHOT_VERSION ||
+			header->max_order > BUDDY_SNAPSHOT_MAX_ORDER ||
+			header->page_size != (uint32_t)allocator->page_size ||
+			header->max_order != (uint32_t)allocator->max_order) {
+		munmap(image, st.st_size);
+		return -1;
+	}
+	maps.max_order = header->max_order;
+	nr_words = buddy_snapshot_offset(maps.max_order, maps.max_order + 1);
+	if ((size_t)st.st_size != sizeof(*header) + nr_words * sizeof(uint64_t)) {
+		munmap(image, st.st_size);
+		return -1;
+	}
+	maps.used = (const uint64_t *)(header + 1);
+	maps.split = (uint64_t *)calloc(sizeof(uint64_t), nr_words);
+	if (maps.split == NULL || buddy_allocator_init(allocator) != 0) {
+		free(maps.split);
+		munmap(image, st.st_size);
+		return -1;
+	}
+	/* mark the ancestors of every allocated block, stopping at marked ones */
+	for (int order = 0; order < maps.max_order; order++) {
+		const uint64_t *used = maps.used + buddy_snapshot_offset(maps.max_order, order);
+
+		for (size_t w = 0; w < ((1ULL << (maps.max_order - order)) + 63) / 64; w++) {
+			for (uint64_t bits = used[w]; bits != 0; bits &= bits - 1) {
+				uint64_t nr = w * 64 + __builtin_ctzll(bits);
+
+				for (int up = order + 1; up <= maps.max_order; up++) {
+					uint64_t *split = maps.split +
+						buddy_snapshot_offset(maps.max_order, up);
+
+					nr >>= 1;
+					if (buddy_snapshot_test(split, nr)) {
+						break;
+					}
+					buddy_snapshot_set(split, nr);
+				}
+			}
+		}
+	}
+	ret = buddy_snapshot_build(allocator, &maps,
+			buddy_free_list_first(allocator, maps.max_order), 0, maps.max_order);
+	free(maps.split);
+	munmap(image, st.st_size);
+	if (ret != 0) {
+		buddy_allocator_destroy(allocator);
+	}
+
+	return ret;
+}
+
+/* first pair bitmap word of @order, each order has 2^(max_order - order - 1) pairs */
+static inline size_t buddy_shm_pair_offset(int max_order, int order)
+{
+	size_t offset = 0;
+
+	for (int i = 0; i < order; i++) {
+		offset += ((1ULL << (max_order - i - 1)) + 63) / 64;
+	}
+
+	return offset;
+}
+
+static inline bool buddy_shm_change_pair(struct buddy_shm_t *shm, int order, uint64_t page)
+{
+	uint64_t *map = shm->pair_map + buddy_shm_pair_offset(shm->header->max_order, order);
+	uint64_t nr = page >> (order + 1);
+	bool old = (map[nr / 64] >> (nr % 64)) & 1;
+
+	map[nr / 64] ^= 1ULL << (nr % 64);
+
+	return old;
+}
+
+static void buddy_shm_push(struct buddy_shm_t *shm, uint32_t page, int order)
+{
+	struct buddy_shm_header_t *header = shm->header;
+	struct buddy_shm_frame_t *frame = &shm->frames[page];
+
+	frame->order = order;
+	frame->is_used = false;
+	frame->prev = BUDDY_NIL;
+	frame->next = header->order[order].head;
+	if (frame->next != BUDDY_NIL) {
+		shm->frames[frame->next].prev = page;
+	}
+	header->order[order].head = page;
+	if (header->order[order].free_count++ == 0) {
+		header->free_area_mask |= 1ULL << order;
+	}
+}
+
+static void buddy_shm_unlink(struct buddy_shm_t *shm, uint32_t page, int order)
+{
+	struct buddy_shm_header_t *header = shm->header;
+	struct buddy_shm_frame_t *frame = &shm->frames[page];
+
+	if (frame->prev != BUDDY_NIL) {
+		shm->frames[frame->prev].next = frame->next;
+	} else {
+		header->order[order].head = frame->next;
+	}
+	if (frame->next != BUDDY_NIL) {
+		shm->frames[frame->next].prev = frame->prev;
+	}
+	if (--header->order[order].free_count == 0) {
+		header->free_area_mask &= ~(1ULL << order);
+	}
+}
+
+/*
+ * Recompute the free lists, pair bits and counts from the allocated
+ * blocks: each gap between them is cut into the largest aligned blocks
+ * that fit, which is exactly the fully merged free space. Not a single
+ * pass: growing a free block to the next order scans that order's upper
+ * half, and a failed attempt leaves those frames to be read again, so a
+ * frame can be visited once per order. That is up to
+ * max_order * 2^max_order frame reads, all under the segment lock.
+ */
+static void buddy_shm_rebuild(struct buddy_shm_t *shm)
+{
+	struct buddy_shm_header_t *header = shm->header;
+	int max_order = header->max_order;
+	uint64_t page = 0;
+
+	memset(shm->pair_map, 0,
+			buddy_shm_pair_offset(max_order, max_order) * sizeof(uint64_t));
+	header->free_area_mask = 0;
+	for (int i = 0; i <= max_order; i++) {
+		header->order[i].head = BUDDY_NIL;
+		header->order[i].free_count = 0;
+		header->order[i].used_count = 0;
+	}
+	while (page < 1ULL << max_order) {
+		struct buddy_shm_frame_t *frame = &shm->frames[page];
+		int order = 0;
+
+		if (__atomic_load_n(&frame->is_used, __ATOMIC_ACQUIRE)) {
+			header->order[frame->order].used_count++;
+			if (frame->order < max_order) {
+				buddy_shm_change_pair(shm, frame->order, page);
+			}
+			page += 1ULL << frame->order;
+			continue;
+		}
+		/* grow while aligned and no allocated block starts in the upper half */
+		while (order < max_order && (page & (1ULL << order)) == 0) {
+			uint64_t end = page + (2ULL << order);
+			bool clear = true;
+
+			for (uint64_t p = page + (1ULL << order); clear && p < end; p++) {
+				clear = !shm->frames[p].is_used;
+			}
+			if (!clear) {
+				break;
+			}
+			order++;
+		}
+		buddy_shm_push(shm, page, order);
+		if (order < max_order) {
+			buddy_shm_change_pair(shm, order, page);
+		}
+		page += 1ULL << order;
+	}
+}
+
+/*
+ * A holder that died leaves the lock in EOWNERDEAD: rebuild and mark it
+ * consistent. Any other failure, ENOTRECOVERABLE after a survivor gave up
+ * on the repair included, means the segment can no longer be trusted.
+ */
+static int buddy_shm_lock(struct buddy_shm_t *shm)
+{
+	int ret = pthread_mutex_lock(&shm->header->lock);
+
+	if (ret == EOWNERDEAD) {
+		buddy_shm_rebuild(shm);
+		shm->header->recoveries++;
+		ret = pthread_mutex_consistent(&shm->header->lock);
+		if (ret != 0) {
+			pthread_mutex_unlock(&shm->header->lock);
+		}
+	}
+	if (ret != 0) {
+		msg_err("shared segment lock failed: %s", strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void buddy_shm_unlock(struct buddy_shm_t *shm)
+{
+	pthread_mutex_unlock(&shm->header->lock);
+}
+
+static int buddy_shm_map(struct buddy_shm_t *shm, int fd, size_t size)
+{
+	void *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (segment == MAP_FAILED) {
+		return -1;
+	}
+	shm->header = (struct buddy_shm_header_t *)segment;
+	shm->frames = (struct buddy_shm_frame_t *)((char *)segment + shm->header->frames_offset);
+	shm->pair_map = (uint64_t *)((char *)segment + shm->header->pair_offset);
+	shm->data = (char *)segment + shm->header->data_offset;
+	shm->shift = __builtin_ctz(shm->header->page_size);
+
+	return 0;
+}
+
+/*
+ * Create the segment @name holding a pool of 2^max_order pages. It is
+ * sized with ftruncate(), so pages only get backed as they are touched.
+ */
+static int buddy_shm_create(struct buddy_shm_t *shm, const char *name, int page_size,
+		int max_order)
+{
+	struct buddy_shm_header_t header = {
+		.version = BUDDY_SHM_VERSION,
+		.page_size = page_size,
+		.max_order = max_order,
+	};
+	pthread_mutexattr_t attr;
+	int fd;
+
+	if (max_order < 0 || max_order > BUDDY_SHM_MAX_ORDER || page_size <= 0 ||
+			(page_size & (page_size - 1)) != 0) {
+		return -1;
+	}
+	header.frames_offset = (sizeof(header) + 63) & ~63ULL;
+	header.pair_offset = header.frames_offset +
+		(((sizeof(struct buddy_shm_frame_t) << max_order) + 63) & ~63ULL);
+	header.data_offset = header.pair_offset +
+		buddy_shm_pair_offset(max_order, max_order) * sizeof(uint64_t);
+	header.data_offset = (header.data_offset + page_size - 1) & ~((uint64_t)page_size - 1);
+	header.segment_size = header.data_offset + ((uint64_t)page_size << max_order);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, header.segment_size) != 0 ||
+			pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			buddy_shm_map(shm, fd, header.segment_size) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	close(fd);
+	/* attach() refuses the segment until the magic shows up */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->header->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	for (int i = 0; i <= max_order; i++) {
+		shm->header->order[i].head = BUDDY_NIL;
+	}
+	buddy_shm_push(shm, 0, max_order);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(shm->header->magic, BUDDY_SHM_MAGIC, sizeof(shm->header->magic));
+
+	return 0;
+}
+
+static int buddy_shm_attach(struct buddy_shm_t *shm, const char *name)
+{
+	struct buddy_shm_header_t header;
+	struct stat st;
+	int fd, ret;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) ||
+			pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			memcmp(header.magic, BUDDY_SHM_MAGIC, sizeof(header.magic)) != 0 ||
+			header.version != BUDDY_SHM_VERSION ||
+			header.segment_size != (uint64_t)st.st_size) {
+		close(fd);
+		return -1;
+	}
+	ret = buddy_shm_map(shm, fd, header.segment_size);
+	close(fd);
+
+	return ret;
+}
+
+static void buddy_shm_detach(struct buddy_shm_t *shm)
+{
+	munmap(shm->header, shm->header->segment_size);
+	shm->header = NULL;
+}
+
+/* byte offset of a block of @size in the data area, or BUDDY_SHM_NONE */
+static uint64_t buddy_shm_alloc(struct buddy_shm_t *shm, uint64_t size)
+{
+	struct buddy_shm_header_t *header = shm->header;
+	uint64_t pages = (size >> shm->shift) + ((size & (header->page_size - 1)) != 0);
+	int order = buddy_pages_to_order(pages);
+	uint64_t avail;
+	uint32_t page;
+	int cur;
+
+	if (order > (int)header->max_order) {
+		return BUDDY_SHM_NONE;
+	}
+	if (buddy_shm_lock(shm) != 0) {
+		return BUDDY_SHM_NONE;
+	}
+	avail = header->free_area_mask >> order;
+	if (avail == 0) {
+		header->failures++;
+		buddy_shm_unlock(shm);
+		return BUDDY_SHM_NONE;
+	}
+	cur = order + __builtin_ctzll(avail);
+	page = header->order[cur].head;
+	buddy_shm_unlink(shm, page, cur);
+	if (cur < (int)header->max_order) {
+		buddy_shm_change_pair(shm, cur, page);
+	}
+	while (cur > order) {
+		cur--;
+		buddy_shm_push(shm, page + (1U << cur), cur);
+		buddy_shm_change_pair(shm, cur, page);
+	}
+	/*
+	 * buddy_shm_rebuild() recovers everything from is_used and the order
+	 * of used frames, so a holder dying between these two stores must not
+	 * leave is_used set next to a stale order.
+	 */
+	shm->frames[page].order = order;
+	__atomic_store_n(&shm->frames[page].is_used, true, __ATOMIC_RELEASE);
+	header->order[order].used_count++;
+	header->allocs++;
+	buddy_shm_unlock(shm);
+
+	return (uint64_t)page << shm->shift;
+}
+
+static int buddy_shm_free(struct buddy_shm_t *shm, uint64_t offset)
+{
+	struct buddy_shm_header_t *header = shm->header;
+	uint64_t page = offset >> shm->shift;
+	int order;
+
+	if (offset >= (uint64_t)header->page_size << header->max_order ||
+			(offset & (header->page_size - 1)) != 0) {
+		msg_err("free of unknown shared offset 0x%" PRIx64, offset);
+		return -1;
+	}
+	if (buddy_shm_lock(shm) != 0) {
+		return -1;
+	}
+	if (!shm->frames[page].is_used) {
+		buddy_shm_unlock(shm);
+		msg_err("free of unknown shared offset 0x%" PRIx64, offset);
+		return -1;
+	}
+	/* once is_used is clear buddy_shm_rebuild() treats the block as free */
+	order = shm->frames[page].order;
+	__atomic_store_n(&shm->frames[page].is_used, false, __ATOMIC_RELEASE);
+	header->order[order].used_count--;
+	header->frees++;
+	while (order < (int)header->max_order && buddy_shm_change_pair(shm, order, page)) {
+		buddy_shm_unlink(shm, page ^ (1ULL << order), order);
+		page &= ~(1ULL << order);
+		order++;
+	}
+	buddy_shm_push(shm, page, order);
+	buddy_shm_unlock(shm);
+
+	return 0;
+}
+
+static inline void* buddy_shm_ptr(struct buddy_shm_t *shm, uint64_t offset)
+{
+	return shm->data + offset;
+}
+
+/*
+ * Snapshot of the allocator's counters. Each order is read under its own
+ * lock, so the orders are individually consistent but not with each other.
+ */
+static int buddy_get_stats(struct buddy_allocator_t *allocator, struct buddy_stats_t *stats)
+{
+#ifdef BUDDY_STATS
+	struct buddy_thread_cache_t *cache;
+#endif
+
+	memset(stats, 0, sizeof(*stats));
+	stats->max_order = buddy_max_order(allocator);
+	stats->bytes_requested = __atomic_load_n(&allocator->bytes_requested, __ATOMIC_RELAXED);
+	stats->bytes_allocated = __atomic_load_n(&allocator->bytes_allocated, __ATOMIC_RELAXED);
+	stats->compactions = allocator->compactions;
+	for (int i = 0; i <= stats->max_order; i++) {
+		struct buddy_list_t *buddy_list = &allocator->buddy_list[i];
+
+		buddy_lock_order(allocator, i);
+		stats->order[i].free_blocks = buddy_list->free_count;
+		stats->order[i].used_blocks = buddy_list->used_count;
+		stats->order[i].pair_splits = buddy_list->splits;
+		stats->order[i].pair_merges = buddy_list->merges;
+		buddy_unlock_order(allocator, i);
+	}
+#ifdef BUDDY_STATS
+	pthread_mutex_lock(&allocator->lock);
+	list_for_each_entry(cache, &allocator->caches, link) {
+		stats->nr_threads++;
+		for (int i = 0; i <= stats->max_order; i++) {
+			struct buddy_order_stats_t *sum = &stats->order[i].ops;
+			struct buddy_order_stats_t *ops = &cache->stats[i];
+			unsigned long split_depth = __atomic_load_n(&ops->max_split_depth,
+					__ATOMIC_RELAXED);
+			unsigned long merge_depth = __atomic_load_n(&ops->max_merge_depth,
+					__ATOMIC_RELAXED);
+
+			sum->allocs += __atomic_load_n(&ops->allocs, __ATOMIC_RELAXED);
+			sum->frees += __atomic_load_n(&ops->frees, __ATOMIC_RELAXED);
+			sum->failures += __atomic_load_n(&ops->failures, __ATOMIC_RELAXED);
+			sum->splits += __atomic_load_n(&ops->splits, __ATOMIC_RELAXED);
+			sum->merges += __atomic_load_n(&ops->merges, __ATOMIC_RELAXED);
+			if (split_depth > sum->max_split_depth) {
+				sum->max_split_depth = split_depth;
+			}
+			if (merge_depth > sum->max_merge_depth) {
+				sum->max_merge_depth = merge_depth;
+			}
+		}
+	}
+	pthread_mutex_unlock(&allocator->lock);
+#endif
+
+	return 0;
+}
+
+#ifdef BUDDY_STATS
+static void buddy_print_op_statistics(const struct buddy_stats_t *stats,
+		const char *decorator)
+{
+	printf("%s\n", decorator);
+	printf("%5s%10s%10s%10s%10s%10s%10s%10s\n", "Order", "Allocs", "Frees",
+			"Failures", "Splits", "Merges", "Max Split", "Max Merge");
+	printf("%s\n", decorator);
+	for (int i = 0; i <= stats->max_order; i++) {
+		const struct buddy_order_stats_t *ops = &stats->order[i].ops;
+
+		if (ops->allocs == 0 && ops->frees == 0 && ops->failures == 0) {
+			continue;
+		}
+		printf("%5d%10lu%10lu%10lu%10lu%10lu%10lu%10lu\n", i, ops->allocs,
+				ops->frees, ops->failures, ops->splits, ops->merges,
+				ops->max_split_depth, ops->max_merge_depth);
+	}
+	printf("%d thread(s) reported\n", stats->nr_threads);
+}
+#endif
+
+/*
+ * Lock free: reads every order's free count once and derives the rest, so
+ * a monitoring thread can poll it without touching the alloc/free paths.
+ * Blocks parked in magazines and lock-free stacks count as used.
+ */
+static void buddy_get_frag(struct buddy_allocator_t *allocator, struct buddy_frag_t *frag)
+{
+	uint64_t page_size = buddy_page_size(allocator);
+	uint64_t free_pages = 0, suitable_pages = 0;
+	unsigned long suitable_blocks = 0;
+
+	frag->max_order = buddy_max_order(allocator);
+	frag->largest_order = -1;
+	frag->free_blocks = 0;
+	for (int i = 0; i <= frag->max_order; i++) {
+		int count = __atomic_load_n(&allocator->buddy_list[i].free_count, __ATOMIC_RELAXED);
+
+		frag->order[i].free_blocks = count;
+		frag->free_blocks += count;
+		free_pages += (uint64_t)count << i;
+		if (count > 0) {
+			frag->largest_order = i;
+		}
+	}
+	frag->free_bytes = free_pages * page_size;
+	for (int i = frag->max_order; i >= 0; i--) {
+		suitable_blocks += frag->order[i].free_blocks;
+		suitable_pages += (uint64_t)frag->order[i].free_blocks << i;
+		frag->order[i].allocatable_bytes = suitable_pages * page_size;
+		frag->order[i].unusable = free_pages > 0 ?
+			(int)((free_pages - suitable_pages) * 1000 / free_pages) : 1000;
+		if (suitable_blocks > 0) {
+			frag->order[i].extfrag = -1000;
+		} else if (frag->free_blocks == 0) {
+			frag->order[i].extfrag = 0;
+		} else {
+			/* same formula as __fragmentation_index() in mm/vmstat.c */
+			frag->order[i].extfrag = 1000 - (int)((1000 + free_pages * 1000 / (1ULL << i)) /
+					frag->free_blocks);
+		}
+	}
+}
+
+static int buddy_free_block_cmp(const void *a, const void *b)
+{
+	const struct buddy_entry_t *x = *(struct buddy_entry_t * const *)a;
+	const struct buddy_entry_t *y = *(struct buddy_entry_t * const *)b;
+
+	return (x->start_addr > y->start_addr) - (x->start_addr < y->start_addr);
+}
+
+/* address ordered list of free blocks; takes every order lock while collecting */
+static void buddy_print_free_map(struct buddy_allocator_t *allocator)
+{
+	struct buddy_entry_t **blocks;
+	struct buddy_entry_t *entry;
+	int nr = 0, max_order = buddy_max_order(allocator);
+
+	for (int i = 0; i <= max_order; i++) {
+		buddy_lock_order(allocator, i);
+	}
+	for (int i = 0; i <= max_order; i++) {
+		nr += allocator->buddy_list[i].free_count;
+	}
+	blocks = (struct buddy_entry_t **)malloc(sizeof(*blocks) * (nr + 1));
+	if (blocks != NULL) {
+		nr = 0;
+		for (int i = 0; i <= max_order; i++) {
+			list_for_each_entry(entry, &allocator->buddy_list[i].free_entries, link) {
+				blocks[nr++] = entry;
+			}
+		}
+		qsort(blocks, nr, sizeof(*blocks), buddy_free_block_cmp);
+		printf("free map: %d block(s)\n", nr);
+		for (int i = 0; i < nr; i++) {
+			printf("  0x%016" PRIx64 " - 0x%016" PRIx64 " order %d\n",
+					blocks[i]->start_addr, blocks[i]->start_addr +
+					((uint64_t)buddy_page_size(allocator) << blocks[i]->order) - 1,
+					blocks[i]->order);
+		}
+	}
+	for (int i = max_order; i >= 0; i--) {
+		buddy_unlock_order(allocator, i);
+	}
+	free(blocks);
+}
+
+static void buddy_print_fragmentation(struct buddy_allocator_t *allocator, bool free_map)
+{
+	const char *decorator = "===========================================================================";
+	struct buddy_frag_t *frag = (struct buddy_frag_t *)malloc(sizeof(*frag));
+
+	if (frag == NULL) {
+		return;
+	}
+	buddy_get_frag(allocator, frag);
+	printf("%s\n", decorator);
+	if (frag->largest_order >= 0) {
+		printf("largest allocatable order %d (%" PRIu64 " bytes), ", frag->largest_order,
+				(uint64_t)buddy_page_size(allocator) << frag->largest_order);
+	} else {
+		printf("nothing allocatable, ");
+	}
+	printf("%" PRIu64 " bytes free in %lu block(s)\n", frag->free_bytes, frag->free_blocks);
+	printf("%s\n", decorator);
+	printf("%8s%14s%25s%14s%14s\n", "Order", "Free Blocks", "Allocatable Bytes",
+			"Extfrag", "Unusable");
+	printf("%s\n", decorator);
+	for (int i = 0; i <= frag->max_order; i++) {
+		printf("%8d%14lu%25" PRIu64 "%14.3f%14.3f\n", i, frag->order[i].free_blocks,
+				frag->order[i].allocatable_bytes, frag->order[i].extfrag / 1000.0,
+				frag->order[i].unusable / 1000.0);
+	}
+	if (free_map) {
+		printf("%s\n", decorator);
+		buddy_print_free_map(allocator);
+	}
+	free(frag);
+}
+
+static void buddy_print_statistics(struct buddy_allocator_t *allocator)
+{
+	int i;
+	const char *decorator = "===========================================================================";
+	int width = strlen(decorator);
+	char *field_names[] = {"Order", "Free Entries", "Used Entries", "Splits", "Merges"};
+	int num_fields = sizeof(field_names)/sizeof(*field_names);
+	int field_width = width / num_fields;
+	char *header = (char *)malloc(width + 1);
+	struct buddy_stats_t *stats = (struct buddy_stats_t *)malloc(sizeof(*stats));
+	int idx = 0;
+
+	if (header == NULL || stats == NULL || buddy_get_stats(allocator, stats) != 0) {
+		free(header);
+		free(stats);
+		return;
+	}
+	for (i = 0; i < num_fields; i++) {
+		idx += sprintf(&header[idx], "%*s", field_width, field_names[i]);
+	}
+
+
+	printf("%s\n", decorator);
+	printf("%s\n", header);
+	printf("%s\n", decorator);
+	for (i = 0; i <= stats->max_order; i++) {
+		printf("%*d%*d%*d%*lu%*lu\n", field_width, i,
+				field_width, stats->order[i].free_blocks,
+				field_width, stats->order[i].used_blocks,
+				field_width, stats->order[i].pair_splits,
+				field_width, stats->order[i].pair_merges);
+
+	}
+	printf("%s\n", decorator);
+	if (allocator->backend == BUDDY_BACKEND_LIST) {
+		int spares = 0;
+
+		for (i = 0; i <= stats->max_order; i++) {
+			spares += allocator->buddy_list[i].spare_count;
+		}
+		printf("entry pool: %d/%d in use, %d spare, high water %d, %d touched\n",
+				allocator->entry_pool.used_count - spares,
+				allocator->entry_pool.total_count, spares,
+				allocator->entry_pool.high_water,
+				allocator->entry_pool.fresh);
+	}
+	printf("metadata: %zu bytes (%s backend)\n", buddy_metadata_size(allocator),
+			allocator->backend == BUDDY_BACKEND_BITMAP ? "bitmap" : "list");
+	if (allocator->lazy_watermark > 0) {
+		printf("lazy coalescing: watermark %d, %lu compaction(s)\n",
+				allocator->lazy_watermark, allocator->compactions);
+	}
+	if (allocator->hot_reserve > 0) {
+		struct buddy_hot_t *hot = &allocator->hot;
+		unsigned long lookups = hot->hits + hot->misses;
+
+		printf("hot order %d: %lu/%lu hit(s) (%.2f%%), %lu refill(s) of %lu block(s), "
+				"%d/%d parked\n", allocator->hot_order, hot->hits, lookups,
+				lookups > 0 ? 100.0 * hot->hits / lookups : 0.0,
+				hot->refills, hot->refill_blocks, hot->stack.count,
+				allocator->hot_reserve);
+	}
+	if (allocator->reserve_blocks > 0) {
+		printf("reserve: %d free block(s) held at order mask 0x%llx\n",
+				allocator->reserve_blocks,
+				(unsigned long long)allocator->reserve_orders);
+	}
+	if (allocator->low_watermark > 0) {
+		printf("pressure: watermarks %" PRIu64 "/%" PRIu64 " pages, %" PRIu64
+				" free, %lu low event(s)\n", allocator->low_watermark,
+				allocator->high_watermark, allocator->free_pages,
+				allocator->pressure_events);
+	}
+	if (allocator->shrinkers.next != NULL) {
+		struct buddy_shrinker_t *shrinker;
+
+		pthread_mutex_lock(&allocator->shrinker_lock);
+		list_for_each_entry(shrinker, &allocator->shrinkers, link) {
+			if (shrinker->calls > 0) {
+				printf("shrinker %s (cost %d): %lu call(s), %lu reclaimed\n",
+						shrinker->name, shrinker->cost, shrinker->calls,
+						shrinker->reclaimed);
+			}
+		}
+		pthread_mutex_unlock(&allocator->shrinker_lock);
+	}
+	if (allocator->coalescer != NULL) {
+		printf("async free: %lu deferred in %lu batch(es), %lu wakeup(s), %lu reserve split(s)\n",
+				__atomic_load_n(&allocator->coalescer->deferred, __ATOMIC_RELAXED),
+				__atomic_load_n(&allocator->coalescer->batches, __ATOMIC_RELAXED),
+				__atomic_load_n(&allocator->coalescer->wakeups, __ATOMIC_RELAXED),
+				__atomic_load_n(&allocator->coalescer->refills, __ATOMIC_RELAXED));
+	}
+	if (allocator->bytes_allocated > 0) {
+		printf("internal fragmentation: %llu bytes requested, %llu handed out (%.2f%% wasted)\n",
+				allocator->bytes_requested, allocator->bytes_allocated,
+				100.0 * (allocator->bytes_allocated - allocator->bytes_requested) /
+				allocator->bytes_allocated);
+	}
+#ifdef BUDDY_STATS
+	buddy_print_op_statistics(stats, decorator);
+#endif
+	if (buddy_caches_enabled(allocator) && !list_empty(&allocator->caches)) {
+		struct buddy_thread_cache_t *cache;
+
+		printf("%s\n", decorator);
+		printf("%12s%8s%12s%12s%12s%12s%8s\n", "Thread", "Order", "Alloc Hit",
+				"Alloc Miss", "Free Hit", "Free Miss", "Cached");
+		printf("%s\n", decorator);
+		pthread_mutex_lock(&allocator->lock);
+		list_for_each_entry(cache, &allocator->caches, link) {
+			for (i = 0; i < BUDDY_CACHE_ORDERS; i++) {
+				struct buddy_magazine_t *mag = &cache->mag[i];
+
+				if (mag->depth == 0) {
+					continue;
+				}
+				printf("%12d%8d%12lu%12lu%12lu%12lu%8d\n", cache->id, i,
+						mag->alloc_hits, mag->alloc_misses,
+						mag->free_hits, mag->free_misses, mag->count);
+			}
+		}
+		pthread_mutex_unlock(&allocator->lock);
+	}
+	if (allocator->lockfree_orders > 0) {
+		printf("%s\n", decorator);
+		printf("%8s%12s%12s%12s%12s%8s\n", "Order", "Pop Hit", "Pop Miss",
+				"Push Hit", "Push Full", "Parked");
+		printf("%s\n", decorator);
+		for (i = 0; i < allocator->lockfree_orders; i++) {
+			struct buddy_lf_stack_t *stack = &allocator->lf_stack[i];
+
+			printf("%8d%12lu%12lu%12lu%12lu%8d\n", i, stack->pop_hits,
+					stack->pop_misses, stack->push_hits,
+					stack->push_overflows, stack->count);
+		}
+	}
+	free(stats);
+	free(header);
+}
+/*
+ * Arena node @node stands for NUMA node @node: keep its region's pages
+ * there. Nothing is touched before this, so first faults already obey the
+ * policy. Without such a NUMA node the arena only emulates it.
+ */
+static void buddy_node_bind(struct buddy_allocator_t *allocator, int node)
+{
+	unsigned long mask = 1UL << node;
+	char path[64];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+	if (access(path, F_OK) != 0) {
+		return;
+	}
+	if (syscall(__NR_mbind, allocator->base, allocator->region_size, MPOL_BIND,
+				&mask, sizeof(mask) * 8 + 1, 0) != 0) {
+		msg_err("mbind to node %d failed: %s", node, strerror(errno));
+	}
+}
+
+static int buddy_node_distance(int from, int to)
+{
+	char path[64];
+	FILE *file;
+	int distance = (from == to) ? 10 : 20;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", from);
+	file = fopen(path, "r");
+	if (file == NULL) {
+		return distance;
+	}
+	for (int i = 0; i <= to; i++) {
+		if (fscanf(file, "%d", &distance) != 1) {
+			distance = (from == to) ? 10 : 20;
+			break;
+		}
+	}
+	fclose(file);
+
+	return distance;
+}
+
+/*
+ * Every node is a copy of @template, a configuration that was never
+ * initialized, placed one node size after the other. A template trace is
+ * shared by the nodes, which record distinct ids into it, and is closed
+ * by buddy_arena_destroy().
+ */
+static int buddy_arena_init(struct buddy_arena_t *arena,
+		struct buddy_allocator_t *template, int nr_nodes)
+{
+	/* an initialized template would hand its lists to every node */
+	if (nr_nodes <= 0 || nr_nodes > BUDDY_ARENA_MAX_NODES || template->caches.next != NULL ||
+			template->max_order + ffs(template->page_size) - 1 >= 64 - 6) {
+		return -1;
+	}
+	/* the entry pool table bounds the indices, the ids must fit 32 bits */
+	if (template->trace != NULL && (uint64_t)nr_nodes * ((2ULL << template->max_order) +
+			(template->max_order + 1) * BUDDY_SPARE_MAX) > UINT32_MAX) {
+		return -1;
+	}
+	arena->node_size = (uint64_t)template->page_size << template->max_order;
+	if (template->start_addr + arena->node_size * nr_nodes - 1 < template->start_addr) {
+		return -1;
+	}
+	arena->nr_nodes = nr_nodes;
+	arena->start_addr = template->start_addr;
+	/* allocators embed 64-byte aligned members */
+	if (posix_memalign((void **)&arena->nodes, 64, sizeof(*arena->nodes) * nr_nodes) == 0) {
+		memset(arena->nodes, 0, sizeof(*arena->nodes) * nr_nodes);
+	} else {
+		arena->nodes = NULL;
+	}
+	arena->spill_order = calloc(sizeof(*arena->spill_order), nr_nodes);
+	arena->stats = (struct buddy_node_stats_t *)aligned_alloc(64,
+			sizeof(*arena->stats) * nr_nodes);
+	if (arena->nodes == NULL || arena->spill_order == NULL || arena->stats == NULL) {
+		free(arena->nodes);
+		free(arena->spill_order);
+		free(arena->stats);
+		return -1;
+	}
+	memset(arena->stats, 0, sizeof(*arena->stats) * nr_nodes);
+
+	for (int i = 0; i < nr_nodes; i++) {
+		struct buddy_allocator_t *node = &arena->nodes[i];
+		int *order = arena->spill_order[i];
+
+		/* every setting of the template, only the placement differs */
+		*node = *template;
+		node->start_addr = template->start_addr + i * arena->node_size;
+		node->trace_node = i;
+		node->trace_stride = nr_nodes;
+		/* a failed init destroys the node, which must not close the trace */
+		node->trace = NULL;
+		if (buddy_allocator_init(node) != 0) {
+			while (--i >= 0) {
+				arena->nodes[i].trace = NULL;
+				buddy_allocator_destroy(&arena->nodes[i]);
+			}
+			free(arena->nodes);
+			free(arena->spill_order);
+			free(arena->stats);
+			return -1;
+		}
+		node->trace = template->trace;
+		if (node->base != NULL) {
+			buddy_node_bind(node, i);
+		}
+
+		/* insertion sort of the other nodes by distance, ties by id */
+		for (int j = 0, n = 0; j < nr_nodes; j++) {
+			int k = n++, dist;
+
+			if (j == i) {
+				n--;
+				continue;
+			}
+			dist = buddy_node_distance(i, j);
+			while (k > 0 && buddy_node_distance(i, order[k - 1]) > dist) {
+				order[k] = order[k - 1];
+				k--;
+			}
+			order[k] = j;
+		}
+	}
+
+	return 0;
+}
+
+static void buddy_arena_destroy(struct buddy_arena_t *arena)
+{
+	/* the nodes share the template's trace, closed once with the last node */
+	for (int i = 0; i < arena->nr_nodes; i++) {
+		if (i != arena->nr_nodes - 1) {
+			arena->nodes[i].trace = NULL;
+		}
+		buddy_allocator_destroy(&arena->nodes[i]);
+	}
+	free(arena->nodes);
+	free(arena->spill_order);
+	free(arena->stats);
+	arena->nodes = NULL;
+	arena->nr_nodes = 0;
+}
+
+static int buddy_arena_current_node(struct buddy_arena_t *arena)
+{
+	unsigned int cpu, node;
+
+	if (getcpu(&cpu, &node) != 0) {
+		return 0;
+	}
+
+	return node % arena->nr_nodes;
+}
+
+static struct buddy_entry_t* buddy_arena_alloc_node(struct buddy_arena_t *arena,
+		int node, uint64_t size)
+{
+	struct buddy_entry_t *entry;
+
+	entry = buddy_alloc(&arena->nodes[node], size);
+	if (entry != NULL) {
+		__atomic_fetch_add(&arena->stats[node].local_allocs, 1, __ATOMIC_RELAXED);
+		return entry;
+	}
+	if (arena->spill == BUDDY_SPILL_NEAREST) {
+		for (int i = 0; i < arena->nr_nodes - 1; i++) {
+			int other = arena->spill_order[node][i];
+
+			entry = buddy_alloc(&arena->nodes[other], size);
+			if (entry != NULL) {
+				__atomic_fetch_add(&arena->stats[node].spilled_out, 1,
+						__ATOMIC_RELAXED);
+				__atomic_fetch_add(&arena->stats[other].spilled_in, 1,
+						__ATOMIC_RELAXED);
+				return entry;
+			}
+		}
+	}
+	__atomic_fetch_add(&arena->stats[node].failures, 1, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+static struct buddy_entry_t* buddy_arena_alloc(struct buddy_arena_t *arena, uint64_t size)
+{
+	return buddy_arena_alloc_node(arena, buddy_arena_current_node(arena), size);
+}
+
+static void buddy_arena_free(struct buddy_arena_t *arena, struct buddy_entry_t *entry)
+{
+	int node = (entry->start_addr - arena->start_addr) / arena->node_size;
+
+	buddy_free(&arena->nodes[node], entry);
+}
+
+static void buddy_arena_drain(struct buddy_arena_t *arena)
+{
+	for (int i = 0; i < arena->nr_nodes; i++) {
+		buddy_thread_cache_drain(&arena->nodes[i]);
+		buddy_lf_drain(&arena->nodes[i]);
+	}
+}
+
+static void buddy_arena_print_statistics(struct buddy_arena_t *arena)
+{
+	const char *decorator = "===========================================================================";
+
+	for (int i = 0; i < arena->nr_nodes; i++) {
+		printf("%s\nnode %d: start_addr(0x%" PRIx64 ")\n", decorator, i,
+				arena->nodes[i].start_addr);
+		buddy_print_statistics(&arena->nodes[i]);
+	}
+	printf("%s\n", decorator);
+	printf("%8s%14s%14s%14s%14s\n", "Node", "Local", "Spilled In",
+			"Spilled Out", "Failed");
+	printf("%s\n", decorator);
+	for (int i = 0; i < arena->nr_nodes; i++) {
+		printf("%8d%14lu%14lu%14lu%14lu\n", i, arena->stats[i].local_allocs,
+				arena->stats[i].spilled_in, arena->stats[i].spilled_out,
+				arena->stats[i].failures);
+	}
+}
+
+/*
+ * Micro-benchmarks, selected with --bench. Each workload gets a fresh
+ * allocator configured from the command line, times every operation with
+ * CLOCK_MONOTONIC and prints ops/sec and latency percentiles as JSON.
+ * alloc-loop sets the number of rounds and sub-loop the blocks per round.
+ */
+enum buddy_bench_workload_t {
+	BUDDY_BENCH_CHURN,	/* alloc a fixed size block, free it at once */
+	BUDDY_BENCH_RANDOM,	/* random sizes up to alloc-size, random free order */
+	BUDDY_BENCH_LIFO,	/* fill a window, free newest first */
+	BUDDY_BENCH_FIFO,	/* fill a window, free oldest first */
+	BUDDY_BENCH_PRODCONS,	/* one thread allocates, another frees */
+	BUDDY_BENCH_GROW,	/* fill a window, each block doubled from a page */
+	BUDDY_BENCH_SLAB,	/* random sub-page objects, random free order */
+	BUDDY_BENCH_NR,
+};
+
+static const char *buddy_bench_names[BUDDY_BENCH_NR] = {
+	"churn", "random", "lifo", "fifo", "prodcons", "grow", "slab",
+};
+
+static int buddy_bench_parse(char *arg, int *mask)
+{
+	char *saveptr = NULL;
+
+	*mask = 0;
+	for (char *name = strtok_r(arg, ",", &saveptr); name != NULL;
+			name = strtok_r(NULL, ",", &saveptr)) {
+		int i;
+
+		if (strcmp(name, "all") == 0) {
+			*mask |= (1 << BUDDY_BENCH_NR) - 1;
+			continue;
+		}
+		for (i = 0; i < BUDDY_BENCH_NR; i++) {
+			if (strcmp(name, buddy_bench_names[i]) == 0) {
+				break;
+			}
+		}
+		if (i == BUDDY_BENCH_NR) {
+			return -1;
+		}
+		*mask |= 1 << i;
+	}
+
+	return *mask != 0 ? 0 : -1;
+}
+
+static int parse_args(int argc, char **argv)
+{
+	int c, option_index;
+
+	while (1) {
+
+		c = getopt_long(argc, argv, option_str, long_options,
+				&option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				prog_args.help = true;
+				break;
+			case 'v':
+				prog_args.is_verbose = true;
+				break;
+			case 'o':
+				prog_args.max_order = strtol(optarg, NULL, 10);
+				if (prog_args.max_order == 0) {
+					msg_err("invaliid max-order");
+					return -1;
+				}
+				break;
+			case 's':
+				if (*optarg == '-') {
+					msg_err("invalid start-addr");
+					return -1;
+				}
+				prog_args.start_addr = strtoull(optarg, NULL, 0);
+				break;
+			case 'p':
+				prog_args.page_size = strtol(optarg, NULL, 10);
+				if (prog_args.page_size == 0 ||\
+						(prog_args.page_size & (prog_args.page_size - 1))) {
+					msg_err("invalid page-size");
+					return -1;
+				}
+				break;
+			case 'l':
+				prog_args.alloc_loop = strtol(optarg, NULL, 10);
+				if (prog_args.alloc_loop < 0) {
+					msg_err("invalid alloc-loop");
+					return -1;
+				}
+				break;
+			case 'a':
+				if (*optarg == '-') {
+					msg_err("invalid alloc-size");
+					return -1;
+				}
+				prog_args.alloc_size = strtoull(optarg, NULL, 10);
+				break;
+			case 'n':
+				prog_args.sub_loop = strtol(optarg, NULL, 10);
+				if (prog_args.sub_loop < 0) {
+					msg_err("invalid sub-loop");
+					return -1;
+				}
+				break;
+			case 'b':
+				if (strcmp(optarg, "list") == 0) {
+					prog_args.backend = BUDDY_BACKEND_LIST;
+				} else if (strcmp(optarg, "bitmap") == 0) {
+					prog_args.backend = BUDDY_BACKEND_BITMAP;
+				} else {
+					msg_err("invalid backend");
+					return -1;
+				}
+				break;
+			case 'c': {
+				char *str = optarg;
+
+				/* comma separated depths for orders 0, 1, ... */
+				for (int i = 0; i < BUDDY_CACHE_ORDERS && *str; i++) {
+					prog_args.cache_depth[i] = strtol(str, &str, 10);
+					if (prog_args.cache_depth[i] < 0 ||
+							prog_args.cache_depth[i] > BUDDY_CACHE_DEPTH_MAX) {
+						msg_err("invalid cache-depth");
+						return -1;
+					}
+					if (*str == ',') {
+						str++;
+					}
+				}
+				break;
+			}
+			case 'f':
+				prog_args.lockfree_orders = strtol(optarg, NULL, 10);
+				if (prog_args.lockfree_orders < 0 ||
+						prog_args.lockfree_orders > BUDDY_LF_ORDERS_MAX) {
+					msg_err("invalid lockfree orders");
+					return -1;
+				}
+				break;
+			case 'N':
+				prog_args.nr_nodes = strtol(optarg, NULL, 10);
+				if (prog_args.nr_nodes <= 0 ||
+						prog_args.nr_nodes > BUDDY_ARENA_MAX_NODES) {
+					msg_err("invalid nodes");
+					return -1;
+				}
+				break;
+			case 'S':
+				if (strcmp(optarg, "nearest") == 0) {
+					prog_args.spill = BUDDY_SPILL_NEAREST;
+				} else if (strcmp(optarg, "none") == 0) {
+					prog_args.spill = BUDDY_SPILL_NONE;
+				} else {
+					msg_err("invalid spill policy");
+					return -1;
+				}
+				break;
+			case 'm':
+				if (strcmp(optarg, "none") == 0) {
+					prog_args.memory = BUDDY_MEMORY_NONE;
+				} else if (strcmp(optarg, "mmap") == 0) {
+					prog_args.memory = BUDDY_MEMORY_MMAP;
+				} else if (strcmp(optarg, "thp") == 0) {
+					prog_args.memory = BUDDY_MEMORY_THP;
+				} else if (strcmp(optarg, "hugetlb") == 0) {
+					prog_args.memory = BUDDY_MEMORY_HUGETLB;
+				} else {
+					msg_err("invalid memory mode");
+					return -1;
+				}
+				break;
+			case 'B':
+				prog_args.bulk = strtol(optarg, NULL, 10);
+				if (prog_args.bulk <= 0) {
+					msg_err("invalid bulk");
+					return -1;
+				}
+				break;
+			case 'L':
+				prog_args.lazy_watermark = strtol(optarg, NULL, 10);
+				if (prog_args.lazy_watermark <= 0) {
+					msg_err("invalid lazy watermark");
+					return -1;
+				}
+				break;
+			case 'U':
+				prog_args.track_used = true;
+				break;
+			case 'M':
+				prog_args.free_map = true;
+				/* fall through */
+			case 'F':
+				prog_args.frag = true;
+				break;
+			case 'A':
+				prog_args.align = strtoull(optarg, NULL, 10);
+				if (prog_args.align == 0 || (prog_args.align & (prog_args.align - 1)) != 0) {
+					msg_err("align should be a power of two");
+					return -1;
+				}
+				break;
+			case 'E':
+				prog_args.exact = true;
+				break;
+			case 'P':
+				if (strcmp(optarg, "lifo") == 0) {
+					prog_args.policy = BUDDY_POLICY_LIFO;
+				} else if (strcmp(optarg, "address") == 0) {
+					prog_args.policy = BUDDY_POLICY_ADDRESS;
+				} else {
+					msg_err("invalid policy");
+					return -1;
+				}
+				break;
+			case 'd':
+				prog_args.async_free = true;
+				break;
+			case 'C':
+				prog_args.compare = true;
+				break;
+			case 'w': {
+				char *str = optarg;
+
+				/* free pages; high defaults to twice low */
+				prog_args.low_watermark = strtoull(str, &str, 10);
+				if (*str == ',') {
+					prog_args.high_watermark = strtoull(str + 1, &str, 10);
+				}
+				if (prog_args.low_watermark == 0 || (prog_args.high_watermark != 0 &&
+							prog_args.high_watermark <= prog_args.low_watermark)) {
+					msg_err("invalid watermark");
+					return -1;
+				}
+				break;
+			}
+			case 'H': {
+				char *str = optarg;
+
+				prog_args.hot_order = strtol(str, &str, 10);
+				prog_args.hot_reserve = BUDDY_HOT_DEPTH;
+				if (*str == ',') {
+					prog_args.hot_reserve = strtol(str + 1, &str, 10);
+				}
+				if (prog_args.hot_order < 0 || prog_args.hot_reserve <= 0 ||
+						prog_args.hot_reserve > BUDDY_HOT_DEPTH_MAX) {
+					msg_err("invalid hot order");
+					return -1;
+				}
+				break;
+			}
+			case 'k': {
+				char *str = optarg;
+
+				/* blocks, then the orders to hold them at (default 0) */
+				prog_args.reserve_blocks = strtol(str, &str, 10);
+				if (prog_args.reserve_blocks <= 0) {
+					msg_err("invalid reserve");
+					return -1;
+				}
+				prog_args.reserve_orders = 1;
+				if (*str == ':') {
+					prog_args.reserve_orders = 0;
+					while (*++str) {
+						int order = strtol(str, &str, 10);
+
+						if (order < 0 || order >= 64 || (*str && *str != ',')) {
+							msg_err("invalid reserve order");
+							return -1;
+						}
+						prog_args.reserve_orders |= 1ULL << order;
+						if (*str == '\0') {
+							break;
+						}
+					}
+					if (prog_args.reserve_orders == 0) {
+						msg_err("invalid reserve order");
+						return -1;
+					}
+				}
+				break;
+			}
+			case 'y':
+				prog_args.snapshot = optarg;
+				break;
+			case 'Y':
+				prog_args.restore = optarg;
+				break;
+			case 'X':
+				prog_args.shm = optarg;
+				break;
+			case 'r':
+				prog_args.record = optarg;
+				break;
+			case 'R':
+				prog_args.replay = optarg;
+				break;
+			case 'W':
+				if (buddy_bench_parse(optarg, &prog_args.bench) != 0) {
+					msg_err("invalid bench workload: %s", optarg);
+					return -1;
+				}
+				break;
+			case 't':
+				prog_args.threads = strtol(optarg, NULL, 10);
+				if (prog_args.threads <= 0) {
+					msg_err("invalid threads");
+					return -1;
+				}
+				break;
+
+			default:
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static const char* usage_string = "buddy_alloc -o max-order -s start-addr -p page-size -l alloc-loop -a alloc-size -n sub-loop -b list|bitmap -c cache-depth[,cache-depth...] -t threads -f lockfree-orders -N nodes -S nearest|none -m none|mmap|thp|hugetlb -B bulk -L lazy-watermark -U -W all|churn|random|lifo|fifo|prodcons|grow|slab[,...] -r record-trace -R replay-trace -F -M -A align -E -P lifo|address -y snapshot -Y restore -X shm-name -d -k blocks[:order,...] -H order[,reserve] -C -w low[,high]";
+static void print_usage()
+{
+	msg_info("USAGE: %s", usage_string);
+}
+
+/* -v: report watermark crossings as they happen */
+static void buddy_driver_pressure(struct buddy_allocator_t *allocator,
+		enum buddy_pressure_t level, void *data)
+{
+	(void)data;
+	msg_info("free memory %s the %s watermark (%" PRIu64 " pages)",
+			level == BUDDY_PRESSURE_LOW ? "fell below" : "is back above",
+			level == BUDDY_PRESSURE_LOW ? "low" : "high",
+			__atomic_load_n(&allocator->free_pages, __ATOMIC_RELAXED));
+}
+
+/*
+ * The drivers hold either entries or, with backing memory, pointers that
+ * get touched so the pages are really used.
+ */
+static void* buddy_driver_alloc(struct buddy_allocator_t *allocator, uint64_t size)
+{
+	char *ptr;
+
+	if (allocator->memory == BUDDY_MEMORY_NONE) {
+		return buddy_alloc(allocator, size);
+	}
+	ptr = (char *)buddy_alloc_ptr(allocator, size);
+	if (ptr != NULL) {
+		ptr[0] = ptr[size - 1] = 0x5a;
+	}
+
+	return ptr;
+}
+
+static void buddy_driver_free(struct buddy_allocator_t *allocator, void *handle)
+{
+	if (allocator->memory == BUDDY_MEMORY_NONE) {
+		buddy_free(allocator, (struct buddy_entry_t *)handle);
+	} else {
+		buddy_free_ptr(allocator, handle);
+	}
+}
+
+static void* buddy_driver_realloc(struct buddy_allocator_t *allocator, void *handle,
+		uint64_t size)
+{
+	if (allocator->memory == BUDDY_MEMORY_NONE) {
+		return buddy_realloc(allocator, (struct buddy_entry_t *)handle, size);
+	}
+
+	return buddy_realloc_ptr(allocator, handle, size);
+}
+
+static void buddy_driver_report(struct buddy_allocator_t *allocator)
+{
+	buddy_print_statistics(allocator);
+	if (prog_args.frag) {
+		buddy_print_fragmentation(allocator, prog_args.free_map);
+	}
+}
+
+/*
+ * Each process maps the segment on its own, at whatever address it gets,
+ * and runs the single threaded pattern with its pid stamped into every
+ * block, checked before the free.
+ */
+static int buddy_shm_worker(const char *name)
+{
+	int nr = prog_args.alloc_loop * prog_args.sub_loop;
+	uint64_t *offsets;
+	struct buddy_shm_t shm;
+	int count = 0, bad = 0;
+	pid_t pid = getpid();
+
+	offsets = (uint64_t *)malloc(sizeof(*offsets) * nr);
+	if (offsets == NULL || buddy_shm_attach(&shm, name) != 0) {
+		free(offsets);
+		return 1;
+	}
+	for (int i = 0; i < prog_args.alloc_loop; i++) {
+		uint64_t size = prog_args.alloc_size << i;
+
+		for (int j = 0; j < prog_args.sub_loop; j++, count++) {
+			offsets[count] = buddy_shm_alloc(&shm, size);
+			if (offsets[count] != BUDDY_SHM_NONE) {
+				pid_t *ptr = (pid_t *)buddy_shm_ptr(&shm, offsets[count]);
+
+				ptr[0] = ptr[size / sizeof(pid_t) - 1] = pid;
+			}
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		uint64_t size = prog_args.alloc_size << (i / prog_args.sub_loop);
+		pid_t *ptr;
+
+		if (offsets[i] == BUDDY_SHM_NONE) {
+			continue;
+		}
+		ptr = (pid_t *)buddy_shm_ptr(&shm, offsets[i]);
+		bad += (ptr[0] != pid || ptr[size / sizeof(pid_t) - 1] != pid);
+		bad += buddy_shm_free(&shm, offsets[i]) != 0;
+	}
+	buddy_shm_detach(&shm);
+	free(offsets);
+
+	return bad != 0;
+}
+
+static int buddy_shm_run(const char *name, int nr_procs)
+{
+	struct buddy_shm_t shm;
+	int ret = 0;
+
+	if (buddy_shm_create(&shm, name, prog_args.page_size, prog_args.max_order) != 0) {
+		msg_err("failed to create shared segment %s", name);
+		return -1;
+	}
+	msg_info("shared pool %s: %" PRIu64 " bytes, %d process(es)", name,
+			shm.header->segment_size, nr_procs);
+	fflush(stdout);
+	for (int i = 0; i < nr_procs; i++) {
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			_exit(buddy_shm_worker(name));
+		} else if (pid < 0) {
+			msg_err("fork failed");
+			ret = -1;
+			break;
+		}
+	}
+	for (int status; wait(&status) > 0; ) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			ret = -1;
+		}
+	}
+	msg_info("allocs(%lu), frees(%lu), failures(%lu), recoveries(%lu)",
+			shm.header->allocs, shm.header->frees, shm.header->failures,
+			shm.header->recoveries);
+	for (uint32_t i = 0; i <= shm.header->max_order; i++) {
+		if (shm.header->order[i].free_count || shm.header->order[i].used_count) {
+			msg_info("order %u: %u free, %u used", i, shm.header->order[i].free_count,
+					shm.header->order[i].used_count);
+		}
+	}
+	if (ret != 0) {
+		msg_err("a worker process failed or saw a corrupted block");
+	}
+	buddy_shm_detach(&shm);
+	shm_unlink(name);
+
+	return ret;
+}
+
+struct worker_args_t {
+	pthread_t thread;
+	struct buddy_allocator_t *allocator;
+	struct buddy_arena_t *arena;
+	int count;
+	int failures;
+};
+
+/*
+ * Same pattern as the single threaded driver, run by every worker
+ * against the shared allocator.
+ */
+static void* buddy_worker(void *data)
+{
+	struct worker_args_t *args = (struct worker_args_t *)data;
+	void **entries;
+
+	entries = (void **)calloc(sizeof(*entries),
+			prog_args.alloc_loop * prog_args.sub_loop);
+	if (entries == NULL) {
+		return NULL;
+	}
+	for (int i = 0; i < prog_args.alloc_loop; i++) {
+		uint64_t size = prog_args.alloc_size << i;
+
+		for (int j = 0; j < prog_args.sub_loop; j++) {
+			if (args->arena != NULL) {
+				entries[args->count] = buddy_arena_alloc(args->arena, size);
+			} else {
+				entries[args->count] = buddy_driver_alloc(args->allocator, size);
+			}
+			if (entries[args->count] == NULL) {
+				args->failures++;
+			}
+			args->count++;
+		}
+	}
+	for (int i = 0; i < args->count; i++) {
+		if (entries[i] == NULL) {
+			continue;
+		}
+		if (args->arena != NULL) {
+			buddy_arena_free(args->arena, (struct buddy_entry_t *)entries[i]);
+		} else {
+			buddy_driver_free(args->allocator, entries[i]);
+		}
+	}
+	if (args->arena != NULL) {
+		buddy_arena_drain(args->arena);
+	} else {
+		buddy_thread_cache_drain(args->allocator);
+	}
+	free(entries);
+
+	return NULL;
+}
+
+static int buddy_run_threads(struct buddy_allocator_t *allocator,
+		struct buddy_arena_t *arena, int nr_threads)
+{
+	struct worker_args_t *workers;
+	struct timespec start, end;
+	int count = 0, failures = 0;
+	double elapsed;
+
+	workers = (struct worker_args_t *)calloc(sizeof(*workers), nr_threads);
+	if (workers == NULL) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nr_threads; i++) {
+		workers[i].allocator = allocator;
+		workers[i].arena = arena;
+		if (pthread_create(&workers[i].thread, NULL, buddy_worker, &workers[i]) != 0) {
+			msg_err("failed to create thread %d", i);
+			nr_threads = i;
+			break;
+		}
+	}
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		count += workers[i].count;
+		failures += workers[i].failures;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	msg_info("%d thread(s) made %d allocations, %d failed", nr_threads, count, failures);
+	msg_info("%.3f ms, %.0f alloc+free pairs/sec", elapsed * 1e3,
+			elapsed > 0 ? count / elapsed : 0.0);
+	free(workers);
+
+	return 0;
+}
+
+/*
+ * Drive the allocator from a trace written by --record. Records are read
+ * straight out of the mapping, only the handle table is allocated. Peak
+ * usage is sampled whenever the live allocated bytes reach a new high.
+ */
+static int buddy_trace_replay(struct buddy_allocator_t *allocator, const char *path)
+{
+	const struct buddy_trace_header_t *header;
+	const struct buddy_trace_record_t *records;
+	uint64_t region = (uint64_t)buddy_page_size(allocator) << buddy_max_order(allocator);
+	uint64_t live_requested = 0, live_allocated = 0;
+	uint64_t peak_requested = 0, peak_allocated = 0, peak_largest = 0;
+	unsigned long failures = 0, bad_records = 0, leaked = 0;
+	uint64_t *sizes;
+	void **handles;
+	struct stat st;
+	uint64_t start;
+	double elapsed;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		msg_err("failed to open trace %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+		msg_err("%s: not a buddy trace", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		msg_err("failed to map trace %s: %s", path, strerror(errno));
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	header = (const struct buddy_trace_header_t *)map;
+	if (memcmp(header->magic, BUDDY_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != BUDDY_TRACE_VERSION ||
+			header->record_size != sizeof(*records) ||
+			(uint64_t)st.st_size != sizeof(*header) +
+				header->nr_records * sizeof(*records)) {
+		msg_err("%s: not a buddy trace", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	records = (const struct buddy_trace_record_t *)(header + 1);
+	handles = (void **)calloc(sizeof(*handles), header->nr_handles + 1);
+	sizes = (uint64_t *)calloc(sizeof(*sizes), header->nr_handles + 1);
+	if (handles == NULL || sizes == NULL) {
+		free(handles);
+		free(sizes);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	start = buddy_trace_now();
+	for (uint64_t i = 0; i < header->nr_records; i++) {
+		const struct buddy_trace_record_t *record = &records[i];
+		uint32_t id = record->handle;
+
+		if (id >= header->nr_handles ||
+				(record->op == BUDDY_TRACE_ALLOC) != (handles[id] == NULL)) {
+			bad_records++;
+			continue;
+		}
+		if (record->op != BUDDY_TRACE_ALLOC) {
+			buddy_driver_free(allocator, handles[id]);
+			handles[id] = NULL;
+			live_requested -= sizes[id];
+			live_allocated -= (uint64_t)buddy_page_size(allocator) <<
+				buddy_size_to_order(allocator, sizes[id]);
+			continue;
+		}
+		handles[id] = buddy_driver_alloc(allocator, record->size);
+		if (handles[id] == NULL) {
+			failures++;
+			continue;
+		}
+		sizes[id] = record->size;
+		live_requested += record->size;
+		live_allocated += (uint64_t)buddy_page_size(allocator) <<
+			buddy_size_to_order(allocator, record->size);
+		if (live_allocated > peak_allocated) {
+			uint64_t mask = __atomic_load_n(&allocator->free_area_mask, __ATOMIC_RELAXED);
+
+			peak_allocated = live_allocated;
+			peak_requested = live_requested;
+			peak_largest = mask != 0 ? (uint64_t)buddy_page_size(allocator) <<
+				(63 - __builtin_clzll(mask)) : 0;
+		}
+	}
+	elapsed = (buddy_trace_now() - start) / 1e9;
+	for (uint32_t i = 0; i < header->nr_handles; i++) {
+		if (handles[i] != NULL) {
+			buddy_driver_free(allocator, handles[i]);
+			leaked++;
+		}
+	}
+
+	msg_info("replayed %" PRIu64 " records (%.3f ms of trace) in %.3f ms, %.0f ops/sec",
+			header->nr_records, header->nr_records > 0 ?
+			records[header->nr_records - 1].timestamp / 1e6 : 0.0,
+			elapsed * 1e3, elapsed > 0 ? header->nr_records / elapsed : 0.0);
+	msg_info("%lu allocation(s) failed, %lu inconsistent record(s), %lu block(s) never freed",
+			failures, bad_records, leaked);
+	msg_info("peak usage: %" PRIu64 " bytes requested, %" PRIu64 " allocated (%.2f%% of region)",
+			peak_requested, peak_allocated, region > 0 ? peak_allocated * 100.0 / region : 0.0);
+	msg_info("at peak: largest free block %" PRIu64 " bytes of %" PRIu64 " free "
+			"(%.2f%% external fragmentation)", peak_largest, region - peak_allocated,
+			region > peak_allocated ? 100.0 - peak_largest * 100.0 /
+			(region - peak_allocated) : 0.0);
+	free(handles);
+	free(sizes);
+	munmap(map, st.st_size);
+
+	return 0;
+}
+
+struct buddy_bench_result_t {
+	uint64_t *alloc_ns;
+	uint64_t *free_ns;
+	int nr_alloc;
+	int nr_free;
+	int failures;
+	double elapsed;
+};
+
+/* blocks in flight between producer and consumer */
+#define BUDDY_BENCH_RING	1024
+
+struct buddy_bench_ring_t {
+	struct buddy_allocator_t *allocator;
+	struct buddy_bench_result_t *result;
+	void *slots[BUDDY_BENCH_RING];
+	bool done;
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+};
+
+static inline uint64_t buddy_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* buddy_bench_alloc(struct buddy_allocator_t *allocator,
+		struct buddy_bench_result_t *result, uint64_t size)
+{
+	uint64_t start = buddy_bench_now();
+	void *handle = buddy_driver_alloc(allocator, size);
+	uint64_t end = buddy_bench_now();
+
+	if (handle == NULL) {
+		result->failures++;
+		return NULL;
+	}
+	result->alloc_ns[result->nr_alloc++] = end - start;
+
+	return handle;
+}
+
+static void buddy_bench_free(struct buddy_allocator_t *allocator,
+		struct buddy_bench_result_t *result, void *handle)
+{
+	uint64_t start;
+
+	if (handle == NULL) {
+		return;
+	}
+	start = buddy_bench_now();
+	buddy_driver_free(allocator, handle);
+	result->free_ns[result->nr_free++] = buddy_bench_now() - start;
+}
+
+static void buddy_bench_churn(struct buddy_allocator_t *allocator,
+		struct buddy_bench_result_t *result)
+{
+	for (int i = 0; i < prog_args.alloc_loop; i++) {
+		for (int j = 0; j < prog_args.sub_loop; j++) {
+			void *handle = buddy_bench_alloc(allocator, result, prog_args.alloc_size);
+
+			buddy_bench_free(allocator, result, handle);
+		}
+	}
+}
+
+/* one alloc sample per block, covering the whole chain of reallocs */
+static void* buddy_bench_grow_one(struct buddy_allocator_t *allocator,
+		struct buddy_bench_result_t *result)
+{
+	uint64_t start = buddy_bench_now();
+	uint64_t size = prog_args.page_size;
+	void *handle = buddy_driver_alloc(allocator, size);
+
+	while (handle != NULL && size < prog_args.alloc_size) {
+		void *grown;
+
+		size = (size * 2 < prog_args.alloc_size) ? size * 2 : prog_args.alloc_size;
+		grown = buddy_driver_realloc(allocator, handle, size);
+		if (grown == NULL) {
+			buddy_driver_free(allocator, handle);
+		}
+		handle = grown;
+	}
+	if (handle == NULL) {
+		result->failures++;
+		return NULL;
+	}
+	result->alloc_ns[result->nr_alloc++] = buddy_bench_now() - start;
+
+	return handle;
+}
+
+static int buddy_bench_window(struct buddy_allocator_t *allocator,
+		struct buddy_bench_result_t *result, int workload)
+{
+	int window = prog_args.sub_loop;
+	uint64_t max_pages = prog_args.alloc_size / prog_args.page_size;
+	unsigned int seed = 1;
+	void **handles;
+	int *order;
+
+	handles = (void **)calloc(sizeof(*handles), window);
+	order = (int *)calloc(sizeof(*order), window);
+	if (handles == NULL || order == NULL) {
+		free(handles);
+		free(order);
+		return -1;
+	}
+	for (int i = 0; i < prog_args.alloc_loop; i++) {
+		for (int j = 0; j < window; j++) {
+			uint64_t size = prog_args.alloc_size;
+
+			if (workload == BUDDY_BENCH_RANDOM) {
+				size = (uint64_t)prog_args.page_size * (1 + rand_r(&seed) % max_pages);
+			}
+			if (workload == BUDDY_BENCH_GROW) {
+				handles[j] = buddy_bench_grow_one(allocator, result);
+			} else {
+				handles[j] = buddy_bench_alloc(allocator, result, size);
+			}
+			order[j] = (workload == BUDDY_BENCH_LIFO) ? window - 1 - j : j;
+		}
+		if (workload == BUDDY_BENCH_RANDOM) {
+			for (int j = window - 1; j > 0; j--) {
+				int k = rand_r(&seed) % (j + 1);
+				int tmp = order[j];
+
+				order[j] = order[k];
+				order[k] = tmp;
+			}
+		}
+		for (int j = 0; j < window; j++) {
+			buddy_bench_free(allocator, result, handles[order[j]]);
+		}
+	}
+	free(handles);
+	free(order);
+
+	return 0;
+}
+
+/* same pattern as the random window, on the slab layer */
+static int buddy_bench_slab(struct buddy_allocator_t *allocator,
+		struct buddy_bench_result_t *result)
+{
+	int window = prog_args.sub_loop;
+	int max_object = BUDDY_SLAB_MIN_OBJECT << (allocator->nr_slab_classes - 1);
+	unsigned int seed = 1;
+	char **objects;
+
+	objects = (char **)calloc(sizeof(*objects), window);
+	if (objects == NULL || allocator->nr_slab_classes == 0) {
+		free(objects);
+		return -1;
+	}
+	for (int i = 0; i < prog_args.alloc_loop; i++) {
+		for (int j = 0; j < window; j++) {
+			int size = 1 + rand_r(&seed) % max_object;
+			uint64_t start = buddy_bench_now();
+
+			objects[j] = (char *)buddy_slab_alloc(allocator, size);
+			if (objects[j] == NULL) {
+				result->failures++;
+				continue;
+			}
+			result->alloc_ns[result->nr_alloc++] = buddy_bench_now() - start;
+			objects[j][0] = objects[j][size - 1] = 0x5a;
+		}
+		for (int j = window - 1; j > 0; j--) {
+			int k = rand_r(&seed) % (j + 1);
+			char *tmp = objects[j];
+
+			objects[j] = objects[k];
+			objects[k] = tmp;
+		}
+		for (int j = 0; j < window; j++) {
+			uint64_t start;
+
+			if (objects[j] == NULL) {
+				continue;
+			}
+			start = buddy_bench_now();
+			buddy_slab_free(allocator, objects[j]);
+			result->free_ns[result->nr_free++] = buddy_bench_now() - start;
+		}
+	}
+	free(objects);
+
+	return 0;
+}
+
+static void* buddy_bench_consumer(void *data)
+{
+	struct buddy_bench_ring_t *ring = (struct buddy_bench_ring_t *)data;
+	unsigned long tail = 0;
+
+	while (1) {
+		void *handle;
+
+		if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) &&
+					tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+		handle = ring->slots[tail % BUDDY_BENCH_RING];
+		__atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+		buddy_bench_free(ring->allocator, ring->result, handle);
+	}
+	buddy_thread_cache_drain(ring->allocator);
+
+	return NULL;
+}
+
+static int buddy_bench_prodcons(struct buddy_allocator_t *allocator,
+		struct buddy_bench_result_t *result)
+{
+	struct buddy_bench_ring_t *ring;
+	pthread_t consumer;
+	unsigned long head = 0;
+
+	if (posix_memalign((void **)&ring, 64, sizeof(*ring)) != 0) {
+		return -1;
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->allocator = allocator;
+	ring->result = result;
+	if (pthread_create(&consumer, NULL, buddy_bench_consumer, ring) != 0) {
+		free(ring);
+		return -1;
+	}
+	for (int i = 0; i < prog_args.alloc_loop * prog_args.sub_loop; i++) {
+		void *handle = buddy_bench_alloc(allocator, result, prog_args.alloc_size);
+
+		if (handle == NULL) {
+			continue;
+		}
+		while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= BUDDY_BENCH_RING) {
+			sched_yield();
+		}
+		ring->slots[head % BUDDY_BENCH_RING] = handle;
+		__atomic_store_n(&ring->head, ++head, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&ring->done, true, __ATOMIC_RELEASE);
+	pthread_join(consumer, NULL);
+	free(ring);
+
+	return 0;
+}
+
+static int buddy_bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile, q in units of 0.01% */
+static uint64_t buddy_bench_percentile(const uint64_t *samples, int nr, int q)
+{
+	if (nr == 0) {
+		return 0;
+	}
+
+	return samples[((uint64_t)nr * q + 9999) / 10000 - 1];
+}
+
+static void buddy_bench_print_latency(const char *name, uint64_t *samples, int nr)
+{
+	qsort(samples, nr, sizeof(*samples), buddy_bench_cmp);
+	printf("\"%s\": {\"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p99.9\": %" PRIu64 "}",
+			name, buddy_bench_percentile(samples, nr, 5000),
+			buddy_bench_percentile(samples, nr, 9900),
+			buddy_bench_percentile(samples, nr, 9990));
+}
+
+static int buddy_bench_workload(const struct buddy_allocator_t *template, int workload,
+		struct buddy_bench_result_t *result)
+{
+	struct buddy_allocator_t allocator = *template;
+	size_t nr_ops = (size_t)prog_args.alloc_loop * prog_args.sub_loop;
+	uint64_t start;
+	int ret = 0;
+
+	memset(result, 0, sizeof(*result));
+	result->alloc_ns = (uint64_t *)calloc(sizeof(uint64_t), nr_ops);
+	result->free_ns = (uint64_t *)calloc(sizeof(uint64_t), nr_ops);
+	if (result->alloc_ns == NULL || result->free_ns == NULL ||
+			buddy_allocator_init(&allocator) != 0) {
+		free(result->alloc_ns);
+		free(result->free_ns);
+		return -1;
+	}
+	start = buddy_bench_now();
+	switch (workload) {
+		case BUDDY_BENCH_CHURN:
+			buddy_bench_churn(&allocator, result);
+			break;
+		case BUDDY_BENCH_PRODCONS:
+			ret = buddy_bench_prodcons(&allocator, result);
+			break;
+		case BUDDY_BENCH_SLAB:
+			ret = buddy_bench_slab(&allocator, result);
+			break;
+		default:
+			ret = buddy_bench_window(&allocator, result, workload);
+			break;
+	}
+	result->elapsed = (buddy_bench_now() - start) / 1e9;
+	buddy_thread_cache_drain(&allocator);
+	buddy_allocator_destroy(&allocator);
+
+	return ret;
+}
+
+static int buddy_bench_run(const struct buddy_allocator_t *template)
+{
+	static const char *memory_names[] = { "none", "mmap", "thp", "hugetlb" };
+	bool first = true;
+
+	printf("{\n  \"config\": {\"backend\": \"%s\", \"max_order\": %d, \"page_size\": %d, "
+			"\"alloc_size\": %" PRIu64 ", \"rounds\": %d, \"window\": %d, "
+			"\"memory\": \"%s\", \"lockfree_orders\": %d, \"lazy_watermark\": %d, "
+			"\"policy\": \"%s\", \"async\": %s, \"reserve\": %d, \"hot_order\": %d},\n"
+			"  \"workloads\": [",
+			template->backend == BUDDY_BACKEND_BITMAP ? "bitmap" : "list",
+			template->max_order, template->page_size, prog_args.alloc_size,
+			prog_args.alloc_loop, prog_args.sub_loop, memory_names[template->memory],
+			template->lockfree_orders, template->lazy_watermark,
+			template->policy == BUDDY_POLICY_ADDRESS ? "address" : "lifo",
+			template->async_free ? "true" : "false", template->reserve_blocks,
+			template->hot_reserve > 0 ? template->hot_order : -1);
+	for (int i = 0; i < BUDDY_BENCH_NR; i++) {
+		struct buddy_bench_result_t result;
+		int ops;
+
+		if (!(prog_args.bench & (1 << i))) {
+			continue;
+		}
+		if (i == BUDDY_BENCH_SLAB && template->memory == BUDDY_MEMORY_NONE) {
+			fprintf(stderr, "[INFO]: bench workload slab needs backing memory, skipped\n");
+			continue;
+		}
+		if (buddy_bench_workload(template, i, &result) != 0) {
+			fflush(stdout);
+			fprintf(stderr, "[ERR]: bench workload %s failed\n", buddy_bench_names[i]);
+			return -1;
+		}
+		ops = result.nr_alloc + result.nr_free;
+		printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"failures\": %d, "
+				"\"seconds\": %.6f, \"ops_per_sec\": %.0f,\n     ",
+				first ? "" : ",", buddy_bench_names[i], ops, result.failures,
+				result.elapsed, result.elapsed > 0 ? ops / result.elapsed : 0.0);
+		buddy_bench_print_latency("alloc_ns", result.alloc_ns, result.nr_alloc);
+		printf(", ");
+		buddy_bench_print_latency("free_ns", result.free_ns, result.nr_free);
+		printf("}");
+		free(result.alloc_ns);
+		free(result.free_ns);
+		first = false;
+	}
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
+
+/*
+ * Allocator comparison, selected with --compare. The main() pattern (a
+ * round of sub-loop blocks, then free them all), the random bench window
+ * and a threaded round run against glibc malloc, jemalloc and tcmalloc
+ * when they can be dlopen'd, and both buddy backends. Every run is a
+ * forked child so RSS and counters start clean; one table is printed.
+ */
+enum buddy_cmp_workload_t {
+	BUDDY_CMP_LOOP,
+	BUDDY_CMP_RANDOM,
+	BUDDY_CMP_THREADS,
+	BUDDY_CMP_NR,
+};
+
+static const char *buddy_cmp_names[BUDDY_CMP_NR] = { "loop", "random", "threads" };
+
+enum buddy_cmp_target_type_t {
+	BUDDY_CMP_MALLOC,
+	BUDDY_CMP_JEMALLOC,
+	BUDDY_CMP_TCMALLOC,
+	BUDDY_CMP_LIST,
+	BUDDY_CMP_BITMAP,
+	BUDDY_CMP_TARGETS,
+};
+
+static const char *buddy_cmp_targets[BUDDY_CMP_TARGETS] = {
+	"malloc", "jemalloc", "tcmalloc", "buddy-list", "buddy-bitmap",
+};
+
+struct buddy_cmp_target_t {
+	void *(*malloc_fn)(size_t size);
+	void (*free_fn)(void *ptr);
+	struct buddy_allocator_t *allocator;
+};
 
-static void buddy_add_free_entry(struct buddy_allocator_t *allocator,
-		struct buddy_entry_t *entry)
+struct buddy_cmp_result_t {
+	bool skipped;
+	unsigned long ops;
+	int failures;
+	double seconds;
+	uint64_t peak_live;
+	long rss_kb;
+	long meta_kb;		/* -1 when the allocator does not tell */
+	long long cache_misses;	/* -1 without perf_event_open */
+	long long branch_misses;
+};
+
+struct buddy_cmp_thread_t {
+	struct buddy_cmp_target_t *target;
+	struct buddy_cmp_result_t result;
+	bool sample_rss;
+	pthread_t thread;
+};
+
+static inline void* buddy_cmp_alloc(struct buddy_cmp_target_t *target, uint64_t size)
 {
-	struct buddy_list_t *buddy_list = &allocator->buddy_list[entry->order];
+	char *ptr;
 
-	if (entry->is_used) {
-		list_del(&entry->link);
-		buddy_list->used_count--;
+	if (target->allocator != NULL) {
+		ptr = (char *)buddy_alloc_ptr(target->allocator, size);
+	} else {
+		ptr = (char *)target->malloc_fn(size);
 	}
-	entry->is_used = false;
-	list_add(&entry->link, &buddy_list->free_entries);
-	buddy_list->free_count++;
+	if (ptr != NULL) {
+		ptr[0] = ptr[size - 1] = 0x5a;
+	}
+
+	return ptr;
 }
 
-static void buddy_remove_free_entry(struct buddy_allocator_t *allocator,
-		struct buddy_entry_t *entry)
+static inline void buddy_cmp_free(struct buddy_cmp_target_t *target, void *ptr)
 {
-	struct buddy_list_t *buddy_list = &allocator->buddy_list[entry->order];
-
-	entry->is_used = true;
-
-	list_del(&entry->link);
-	buddy_list->free_count--;
-	list_add(&entry->link, &buddy_list->used_entries);
-	buddy_list->used_count++;
+	if (ptr == NULL) {
+		return;
+	}
+	if (target->allocator != NULL) {
+		buddy_free_ptr(target->allocator, ptr);
+	} else {
+		target->free_fn(ptr);
+	}
 }
 
-static void buddy_recycle_entry(struct buddy_allocator_t *allocator,
-		struct buddy_entry_t *entry)
+static long buddy_cmp_rss_kb(void)
 {
-	struct buddy_list_t *buddy_list = &allocator->buddy_list[entry->order];
+	long pages = 0;
+	FILE *file = fopen("/proc/self/statm", "r");
 
-	list_del(&entry->link);
-	list_del(&entry->buddy->link);
-	(entry->is_used) ? buddy_list->used_count-- : buddy_list->free_count--;
-	(entry->buddy->is_used) ? buddy_list->used_count-- : buddy_list->free_count--;
+	if (file == NULL) {
+		return 0;
+	}
+	if (fscanf(file, "%*s %ld", &pages) != 1) {
+		pages = 0;
+	}
+	fclose(file);
 
-	free(entry);
-	free(entry->buddy);
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
 }
 
-static int buddy_allocator_init(struct buddy_allocator_t *allocator)
+/* user-space hardware counter covering threads created after the call */
+static int buddy_cmp_counter_open(uint64_t config)
 {
-	struct buddy_entry_t *first_entry;
-	allocator->buddy_list = (struct buddy_list_t *)calloc(sizeof(struct buddy_list_t),
-			allocator->max_order + 1);
+	struct perf_event_attr attr;
 
-	allocator->shift_count = ffs(allocator->page_size) - 1;
-	first_entry = (struct buddy_entry_t *)calloc(sizeof(*first_entry), 1);
-	first_entry->start_addr = allocator->start_addr;
-	first_entry->order = allocator->max_order;
-	first_entry->buddy = NULL;
-	first_entry->parent = NULL;
-	first_entry->is_used = false;
-	for (int i = 0; i <= allocator->max_order; i++) {
-		allocator->buddy_list[i].free_count = 0;
-		allocator->buddy_list[i].used_count = 0;
-		INIT_LIST_HEAD(&allocator->buddy_list[i].free_entries);
-		INIT_LIST_HEAD(&allocator->buddy_list[i].used_entries);
-	}
-	buddy_add_free_entry(allocator, first_entry);
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
 
-	return 0;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
 }
 
-static struct buddy_entry_t* buddy_split_entry(struct buddy_allocator_t *allocator,
-		struct buddy_entry_t *entry)
+static long long buddy_cmp_counter_read(int fd)
 {
-	struct buddy_entry_t *new_entry[2];
-	int new_order = entry->order - 1;
-	int buddy_size = allocator->page_size * new_order;
+	long long count;
 
-	for ( int i = 0; i < 2; i++ ) {
-		new_entry[i] = (struct buddy_entry_t *)\
-			       calloc(sizeof(*entry), 1);
-		new_entry[i]->start_addr = entry->start_addr + i * buddy_size;
-		new_entry[i]->order = new_order;
-		new_entry[i]->parent = entry;
-		INIT_LIST_HEAD(&new_entry[i]->link);
-		new_entry[i]->is_used = false;
-		buddy_add_free_entry(allocator, new_entry[i]);
+	if (fd < 0) {
+		return -1;
+	}
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		count = -1;
 	}
-	new_entry[0]->buddy = new_entry[1];
-	new_entry[1]->buddy = new_entry[0];
+	close(fd);
 
-	return new_entry[1];
+	return count;
 }
 
-static struct buddy_entry_t* buddy_alloc_internal(struct buddy_allocator_t *allocator, int order)
+/*
+ * alloc-loop rounds of sub-loop blocks, freed in allocation order or, for
+ * random, a random order with random page multiples up to alloc-size.
+ */
+static int buddy_cmp_rounds(struct buddy_cmp_target_t *target,
+		struct buddy_cmp_result_t *result, bool random, bool sample_rss)
 {
-	struct buddy_list_t *buddy_list = &allocator->buddy_list[order];
-	struct buddy_entry_t *buddy_entry = NULL;
+	int window = prog_args.sub_loop;
+	uint64_t max_pages = prog_args.alloc_size / prog_args.page_size;
+	unsigned int seed = 1;
+	uint64_t *sizes;
+	void **ptrs;
 
-	if (order > allocator->max_order) {
-		return NULL;
+	ptrs = (void **)calloc(sizeof(*ptrs), window);
+	sizes = (uint64_t *)calloc(sizeof(*sizes), window);
+	if (ptrs == NULL || sizes == NULL) {
+		free(ptrs);
+		free(sizes);
+		return -1;
 	}
+	for (int i = 0; i < prog_args.alloc_loop; i++) {
+		uint64_t live = 0;
+		uint64_t start;
 
-	if (buddy_list->free_count > 0) {
-		buddy_entry = container_of(buddy_list->free_entries.next,
-				struct buddy_entry_t, link);
-		buddy_remove_free_entry(allocator, buddy_entry);
-	} else {
-		buddy_entry = buddy_alloc_internal(allocator, order + 1);
-		if (buddy_entry != NULL) {
-			buddy_entry = buddy_split_entry(allocator, buddy_entry);
-			buddy_remove_free_entry(allocator, buddy_entry);
+		/* sizes and the shuffle are drawn outside the timed part */
+		for (int j = 0; j < window; j++) {
+			sizes[j] = prog_args.alloc_size;
+			if (random) {
+				sizes[j] = (uint64_t)prog_args.page_size * (1 + rand_r(&seed) % max_pages);
+			}
+		}
+		start = buddy_bench_now();
+		for (int j = 0; j < window; j++) {
+			ptrs[j] = buddy_cmp_alloc(target, sizes[j]);
+		}
+		result->seconds += (buddy_bench_now() - start) / 1e9;
+		for (int j = 0; j < window; j++) {
+			if (ptrs[j] == NULL) {
+				result->failures++;
+			} else {
+				live += sizes[j];
+			}
 		}
+		if (live > result->peak_live) {
+			result->peak_live = live;
+		}
+		if (sample_rss) {
+			long rss = buddy_cmp_rss_kb();
+
+			if (rss > result->rss_kb) {
+				result->rss_kb = rss;
+			}
+		}
+		for (int j = window - 1; random && j > 0; j--) {
+			int k = rand_r(&seed) % (j + 1);
+			void *tmp = ptrs[j];
+
+			ptrs[j] = ptrs[k];
+			ptrs[k] = tmp;
+		}
+		start = buddy_bench_now();
+		for (int j = 0; j < window; j++) {
+			buddy_cmp_free(target, ptrs[j]);
+		}
+		result->seconds += (buddy_bench_now() - start) / 1e9;
+		result->ops += 2UL * window;
 	}
+	free(ptrs);
+	free(sizes);
 
-	return buddy_entry;
+	return 0;
 }
 
-static void buddy_free_internal(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry)
+static void* buddy_cmp_worker(void *data)
 {
-	struct buddy_entry_t *buddy = entry->buddy;
-	struct buddy_entry_t *parent = entry->parent;
-	struct buddy_list_t *buddy_list = &allocator->buddy_list[entry->order];
+	struct buddy_cmp_thread_t *thread = (struct buddy_cmp_thread_t *)data;
 
-	if (buddy) {
-		if (buddy->is_used) {
-			buddy_add_free_entry(allocator, entry);
-		} else {
-			buddy_recycle_entry(allocator, entry);
-			if (parent != NULL) {
-				buddy_free_internal(allocator, parent);
-			}
-		}
-	} else {
-		buddy_add_free_entry(allocator, entry);
+	buddy_cmp_rounds(thread->target, &thread->result, false, thread->sample_rss);
+	if (thread->target->allocator != NULL) {
+		buddy_thread_cache_drain(thread->target->allocator);
 	}
+
+	return NULL;
 }
 
-static struct buddy_entry_t* buddy_alloc(struct buddy_allocator_t *allocator, int size)
+static int buddy_cmp_threads(struct buddy_cmp_target_t *target,
+		struct buddy_cmp_result_t *result)
 {
-	int page_order = (size >> allocator->shift_count);
+	int nr_threads = prog_args.threads > 0 ? prog_args.threads : 4;
+	struct buddy_cmp_thread_t *threads;
+	uint64_t start;
+	int started;
+
+	threads = (struct buddy_cmp_thread_t *)calloc(sizeof(*threads), nr_threads);
+	if (threads == NULL) {
+		return -1;
+	}
+	start = buddy_bench_now();
+	for (started = 0; started < nr_threads; started++) {
+		threads[started].target = target;
+		threads[started].sample_rss = (started == 0);
+		if (pthread_create(&threads[started].thread, NULL, buddy_cmp_worker,
+					&threads[started]) != 0) {
+			break;
+		}
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i].thread, NULL);
+		result->ops += threads[i].result.ops;
+		result->failures += threads[i].result.failures;
+		result->peak_live += threads[i].result.peak_live;
+		if (threads[i].result.rss_kb > result->rss_kb) {
+			result->rss_kb = threads[i].result.rss_kb;
+		}
+	}
+	result->seconds = (buddy_bench_now() - start) / 1e9;
+	free(threads);
 
-	return buddy_alloc_internal(allocator, page_order);
+	return started == nr_threads ? 0 : -1;
 }
 
-static void buddy_free(struct buddy_allocator_t *allocator, struct buddy_entry_t *entry)
+/* resolve an allocator that ships as a shared object, in the child only */
+static bool buddy_cmp_dlopen(struct buddy_cmp_target_t *target, const char **libs,
+		const char *malloc_name, const char *free_name)
 {
-	buddy_free_internal(allocator, entry);
+	for (int i = 0; libs[i] != NULL; i++) {
+		void *handle = dlopen(libs[i], RTLD_NOW | RTLD_LOCAL);
+
+		if (handle == NULL) {
+			continue;
+		}
+		target->malloc_fn = (void *(*)(size_t))dlsym(handle, malloc_name);
+		target->free_fn = (void (*)(void *))dlsym(handle, free_name);
+		/* a lookup that fell through to libc would compare malloc twice */
+		if (target->malloc_fn != NULL && target->free_fn != NULL &&
+				target->malloc_fn != malloc) {
+			return true;
+		}
+		dlclose(handle);
+	}
+
+	return false;
 }
 
-static void buddy_print_statistics(struct buddy_allocator_t *allocator)
+static void buddy_cmp_child(const struct buddy_allocator_t *template, int type,
+		int workload, struct buddy_cmp_result_t *result)
 {
-	int i;
-	const char *decorator = "===============================================================";
-	int width = strlen(decorator);
-	char *field_names[] = {"Order", "Free Entries", "Used Entries"};
-	int num_fields = sizeof(field_names)/sizeof(*field_names);
-	int field_width = width / num_fields;
-	char *header = (char *)malloc(width + 1);
-	int idx = 0;
+	static const char *jemalloc_libs[] = { "libjemalloc.so.2", "libjemalloc.so", NULL };
+	static const char *tcmalloc_libs[] = {
+		"libtcmalloc_minimal.so.4", "libtcmalloc.so.4", "libtcmalloc.so", NULL,
+	};
+	struct buddy_cmp_target_t target = { malloc, free, NULL };
+	struct buddy_allocator_t allocator = *template;
+	long base_kb;
+	int cache_fd;
+	int branch_fd;
+	int ret;
 
-	for (i = 0; i < num_fields; i++) {
-		idx += sprintf(&header[idx], "%*s", field_width, field_names[i]);
+	memset(result, 0, sizeof(*result));
+	result->meta_kb = -1;
+	switch (type) {
+		case BUDDY_CMP_JEMALLOC:
+			result->skipped = !buddy_cmp_dlopen(&target, jemalloc_libs, "malloc", "free");
+			break;
+		case BUDDY_CMP_TCMALLOC:
+			result->skipped = !buddy_cmp_dlopen(&target, tcmalloc_libs,
+					"tc_malloc", "tc_free");
+			break;
+		case BUDDY_CMP_LIST:
+		case BUDDY_CMP_BITMAP:
+			allocator.backend = (type == BUDDY_CMP_BITMAP) ?
+				BUDDY_BACKEND_BITMAP : BUDDY_BACKEND_LIST;
+			if (allocator.memory == BUDDY_MEMORY_NONE) {
+				allocator.memory = BUDDY_MEMORY_MMAP;
+			}
+			if (allocator.backend == BUDDY_BACKEND_BITMAP) {
+				allocator.lazy_watermark = 0;
+				allocator.reserve_blocks = 0;
+			}
+			if (buddy_allocator_init(&allocator) != 0) {
+				result->failures = -1;
+				return;
+			}
+			target.allocator = &allocator;
+			break;
 	}
+	if (result->skipped) {
+		return;
+	}
+	base_kb = buddy_cmp_rss_kb();
+	cache_fd = buddy_cmp_counter_open(PERF_COUNT_HW_CACHE_MISSES);
+	branch_fd = buddy_cmp_counter_open(PERF_COUNT_HW_BRANCH_MISSES);
+	if (cache_fd >= 0) {
+		ioctl(cache_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	if (branch_fd >= 0) {
+		ioctl(branch_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	if (workload == BUDDY_CMP_THREADS) {
+		ret = buddy_cmp_threads(&target, result);
+	} else {
+		ret = buddy_cmp_rounds(&target, result, workload == BUDDY_CMP_RANDOM, true);
+	}
+	result->cache_misses = buddy_cmp_counter_read(cache_fd);
+	result->branch_misses = buddy_cmp_counter_read(branch_fd);
+	result->rss_kb = (result->rss_kb > base_kb) ? result->rss_kb - base_kb : 0;
+	if (ret != 0) {
+		result->failures = -1;
+	}
+	if (target.allocator != NULL) {
+		result->meta_kb = buddy_metadata_size(target.allocator) / 1024;
+		buddy_allocator_destroy(target.allocator);
+	}
+}
 
+static int buddy_cmp_fork(const struct buddy_allocator_t *template, int type,
+		int workload, struct buddy_cmp_result_t *result)
+{
+	int fds[2];
+	pid_t pid;
+	ssize_t len;
 
-	printf("%s\n", decorator);
-	printf("%s\n", header);
-	printf("%s\n", decorator);
-	for (i = 0; i <= allocator->max_order; i++) {
-		printf("%*d%*d%*d\n", field_width, i,
-				field_width, allocator->buddy_list[i].free_count,
-				field_width, allocator->buddy_list[i].used_count);
-
+	if (pipe(fds) != 0) {
+		return -1;
+	}
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		buddy_cmp_child(template, type, workload, result);
+		len = write(fds[1], result, sizeof(*result));
+		_exit(len == sizeof(*result) ? 0 : 1);
 	}
+	close(fds[1]);
+	len = read(fds[0], result, sizeof(*result));
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
 
+	return len == sizeof(*result) ? 0 : -1;
 }
-static int parse_args(int argc, char **argv)
+
+static void buddy_cmp_print_counter(long long count, unsigned long ops)
 {
-	int c, option_index;
+	if (count < 0 || ops == 0) {
+		printf("%10s", "n/a");
+	} else {
+		printf("%10.2f", (double)count / ops);
+	}
+}
 
-	while (1) {
+static int buddy_compare_run(const struct buddy_allocator_t *template)
+{
+	const char *decorator = "================================================================================================";
 
-		c = getopt_long(argc, argv, option_str, long_options,
-				&option_index);
-		if (c == -1)
-			break;
+	printf("%s\n", decorator);
+	printf("%-14s%-9s%10s%9s%10s%10s%10s%10s%10s%4s\n", "Allocator", "Workload",
+			"Mops/s", "ns/op", "Live KB", "RSS KB", "Meta KB", "LLC/op",
+			"BrMiss/op", "");
+	printf("%s\n", decorator);
+	for (int type = 0; type < BUDDY_CMP_TARGETS; type++) {
+		for (int workload = 0; workload < BUDDY_CMP_NR; workload++) {
+			struct buddy_cmp_result_t result;
 
-		switch (c) {
-			case 'h':
-				prog_args.help = true;
-				break;
-			case 'v':
-				prog_args.is_verbose = true;
-				break;
-			case 'o':
-				prog_args.max_order = strtol(optarg, NULL, 10);
-				if (prog_args.max_order == 0) {
-					msg_err("invaliid max-order");
-					return -1;
-				}
-				break;
-			case 's':
-				prog_args.start_addr = strtol(optarg, NULL, 10);
-				if (prog_args.start_addr < 0) {
-					msg_err("invalid start-addr");
-					return -1;
-				}
-				break;
-			case 'p':
-				prog_args.page_size = strtol(optarg, NULL, 10);
-				if (prog_args.page_size == 0 ||\
-						(prog_args.page_size & (prog_args.page_size - 1))) {
-					msg_err("invalid page-size");
-					return -1;
-				}
-				break;
-			case 'l':
-				prog_args.alloc_loop = strtol(optarg, NULL, 10);
-				if (prog_args.alloc_loop < 0) {
-					msg_err("invalid alloc-loop");
-					return -1;
-				}
-				break;
-			case 'a':
-				prog_args.alloc_size = strtol(optarg, NULL, 10);
-				if (prog_args.alloc_size < 0) {
-					msg_err("invalid alloc-size");
-					return -1;
-				}
-				break;
-			case 'n':
-				prog_args.sub_loop = strtol(optarg, NULL, 10);
-				if (prog_args.sub_loop < 0) {
-					msg_err("invalid sub-loop");
-					return -1;
-				}
+			if (buddy_cmp_fork(template, type, workload, &result) != 0 ||
+					result.failures < 0) {
+				printf("%-14s%-9s%10s\n", buddy_cmp_targets[type],
+						buddy_cmp_names[workload], "failed");
+				continue;
+			}
+			if (result.skipped) {
+				fprintf(stderr, "[INFO]: %s could not be loaded, skipped\n",
+						buddy_cmp_targets[type]);
 				break;
-
-			default:
-				return -1;
+			}
+			printf("%-14s%-9s%10.2f%9.1f%10" PRIu64 "%10ld", buddy_cmp_targets[type],
+					buddy_cmp_names[workload],
+					result.seconds > 0 ? result.ops / result.seconds / 1e6 : 0.0,
+					result.ops > 0 ? result.seconds * 1e9 / result.ops : 0.0,
+					result.peak_live / 1024, result.rss_kb);
+			if (result.meta_kb < 0) {
+				printf("%10s", "-");
+			} else {
+				printf("%10ld", result.meta_kb);
+			}
+			buddy_cmp_print_counter(result.cache_misses, result.ops);
+			buddy_cmp_print_counter(result.branch_misses, result.ops);
+			printf("%4s\n", result.failures > 0 ? "(!)" : "");
 		}
 	}
+	printf("%s\n", decorator);
 
 	return 0;
 }
 
-static const char* usage_string = "buddy_alloc -o max-order -s start-addr -p page-size -l alloc-loop -a alloc-size -n sub-loop";
-static void print_usage()
-{
-	msg_info("USAGE: %s", usage_string);
-}
-
 int main(int argc, char *argv[])
 {
 	struct buddy_allocator_t alloc = {0};
-	struct buddy_entry_t **alloc_entries;
+	struct buddy_entry_t **batch = NULL;
+	int nr_batch = 0;
+	buddy_handle_t *alloc_handles;
+	struct buddy_range_t *alloc_ranges = NULL;
 	int count = 0;
 
+#ifdef BUDDY_FIXED_MAX_ORDER
+	prog_args.max_order = BUDDY_FIXED_MAX_ORDER;
+	prog_args.page_size = BUDDY_FIXED_PAGE_SIZE;
+#endif
 	if (parse_args(argc, argv) != 0) {
 		print_usage();
 		return -1;
@@ -330,7 +6441,7 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	if (prog_args.alloc_size < prog_args.page_size) {
+	if (prog_args.alloc_size < (uint64_t)prog_args.page_size) {
 		msg_err("alloc_size shoud be greater than: %d bytes",
 				prog_args.page_size);
 		return -1;
@@ -338,33 +6449,209 @@ int main(int argc, char *argv[])
 	alloc.max_order = prog_args.max_order;
 	alloc.page_size = prog_args.page_size;
 	alloc.start_addr = prog_args.start_addr;
-	buddy_allocator_init(&alloc);
+	alloc.backend = prog_args.backend;
+	memcpy(alloc.cache_depth, prog_args.cache_depth, sizeof(alloc.cache_depth));
+	alloc.lockfree_orders = prog_args.lockfree_orders;
+	alloc.hot_order = prog_args.hot_order;
+	alloc.hot_reserve = prog_args.hot_reserve;
+	alloc.low_watermark = prog_args.low_watermark;
+	alloc.high_watermark = prog_args.high_watermark;
+	if (prog_args.is_verbose) {
+		alloc.pressure_notify = buddy_driver_pressure;
+	}
+	alloc.memory = prog_args.memory;
+	alloc.lazy_watermark = prog_args.lazy_watermark;
+	alloc.async_free = prog_args.async_free;
+	alloc.reserve_blocks = prog_args.reserve_blocks;
+	alloc.reserve_orders = prog_args.reserve_orders;
+	alloc.track_used = prog_args.track_used;
+	alloc.policy = prog_args.policy;
+	if (prog_args.bench != 0) {
+		return buddy_bench_run(&alloc);
+	}
+	if (prog_args.compare) {
+		return buddy_compare_run(&alloc);
+	}
+	if (prog_args.shm != NULL) {
+		return buddy_shm_run(prog_args.shm, prog_args.threads > 0 ? prog_args.threads : 1);
+	}
+	if (prog_args.nr_nodes > 0) {
+		struct buddy_arena_t arena = {0};
+
+		arena.spill = prog_args.spill;
+		if (prog_args.record != NULL) {
+			alloc.trace = buddy_trace_open(prog_args.record);
+			if (alloc.trace == NULL) {
+				msg_err("failed to create trace %s", prog_args.record);
+				return -1;
+			}
+		}
+		if (buddy_arena_init(&arena, &alloc, prog_args.nr_nodes) != 0) {
+			msg_err("failed to initialize %d node arena", prog_args.nr_nodes);
+			buddy_trace_close(alloc.trace);
+			return -1;
+		}
+		msg_info("arena of %d node(s) initialized, %" PRIu64 " bytes per node",
+				arena.nr_nodes, arena.node_size);
+		buddy_run_threads(NULL, &arena, prog_args.threads > 0 ? prog_args.threads : 1);
+		buddy_arena_drain(&arena);
+		buddy_arena_print_statistics(&arena);
+		buddy_arena_destroy(&arena);
+		return 0;
+	}
+	/* the single threaded driver keeps handles rather than descriptors */
+	alloc.handles = (prog_args.threads == 0 && prog_args.replay == NULL);
+	if (prog_args.restore != NULL) {
+		uint64_t start = buddy_trace_now();
+
+		if (buddy_snapshot_restore(&alloc, prog_args.restore) != 0) {
+			msg_err("failed to restore snapshot %s", prog_args.restore);
+			return -1;
+		}
+		msg_info("restored %s in %.3f ms", prog_args.restore,
+				(buddy_trace_now() - start) / 1e6);
+		buddy_driver_report(&alloc);
+		buddy_allocator_destroy(&alloc);
+		return 0;
+	}
+	if (buddy_allocator_init(&alloc) != 0) {
+		msg_err("failed to initialize buddy allocator");
+		return -1;
+	}
 
 	msg_info("buddy allocator initialized");
-	msg_info("max_order(%d), page_size(%d), start_addr(0x%x)",
+	msg_info("max_order(%d), page_size(%d), start_addr(0x%" PRIx64 ")",
 			alloc.max_order, alloc.page_size, alloc.start_addr);
-	alloc_entries = (struct buddy_entry_t **)calloc(sizeof(*alloc_entries),
+	if (prog_args.record != NULL) {
+		alloc.trace = buddy_trace_open(prog_args.record);
+		if (alloc.trace == NULL) {
+			msg_err("failed to create trace %s", prog_args.record);
+			buddy_allocator_destroy(&alloc);
+			return -1;
+		}
+	}
+	if (prog_args.replay != NULL) {
+		int ret = buddy_trace_replay(&alloc, prog_args.replay);
+
+		buddy_thread_cache_drain(&alloc);
+		buddy_lf_drain(&alloc);
+		if (buddy_defers_merges(&alloc)) {
+			buddy_compact(&alloc);
+		}
+		buddy_driver_report(&alloc);
+		buddy_allocator_destroy(&alloc);
+		return ret;
+	}
+	if (prog_args.threads > 0) {
+		buddy_run_threads(&alloc, NULL, prog_args.threads);
+		buddy_lf_drain(&alloc);
+		if (buddy_defers_merges(&alloc)) {
+			buddy_compact(&alloc);
+		}
+		buddy_driver_report(&alloc);
+		buddy_allocator_destroy(&alloc);
+		return 0;
+	}
+	alloc_handles = (buddy_handle_t *)malloc(sizeof(*alloc_handles) *
 			prog_args.alloc_loop * prog_args.sub_loop);
+	for (int i = 0; i < prog_args.alloc_loop * prog_args.sub_loop; i++) {
+		alloc_handles[i] = BUDDY_HANDLE_NONE;
+	}
+	if (prog_args.exact) {
+		alloc_ranges = (struct buddy_range_t *)calloc(sizeof(*alloc_ranges),
+				prog_args.alloc_loop * prog_args.sub_loop);
+	} else if (prog_args.bulk > 0 && alloc.memory == BUDDY_MEMORY_NONE &&
+			prog_args.align == 0) {
+		batch = (struct buddy_entry_t **)calloc(sizeof(*batch), prog_args.bulk);
+	}
 	for (int i = 0; i < prog_args.alloc_loop; i++) {
-		int size = prog_args.alloc_size << i;
+		uint64_t size = prog_args.alloc_size << i;
 
-		for (int j = 0; j < prog_args.sub_loop; j++) {
-			alloc_entries[count] = buddy_alloc(&alloc, size);
-			if(alloc_entries[count] == NULL) {
+		for (int j = 0; batch != NULL && j < prog_args.sub_loop; j += prog_args.bulk) {
+			int nr = prog_args.sub_loop - j;
+			int got;
+
+			nr = (nr < prog_args.bulk) ? nr : prog_args.bulk;
+			got = buddy_alloc_bulk(&alloc, size, nr, batch);
+			if (got < nr) {
+				msg_err("bulk allocation(%d) got %d of %d", count, got, nr);
+			}
+			for (int k = 0; k < got; k++) {
+				alloc_handles[count + k] = buddy_entry_handle(&alloc, batch[k]);
+			}
+			count += nr;
+		}
+		for (int j = 0; alloc_ranges != NULL && j < prog_args.sub_loop; j++) {
+			if (buddy_alloc_range(&alloc, size, prog_args.align ? prog_args.align : 1,
+						&alloc_ranges[count]) != 0) {
+				msg_err("range allocation(%d) failed", count);
+			}
+			count++;
+		}
+		for (int j = 0; batch == NULL && alloc_ranges == NULL &&
+				j < prog_args.sub_loop; j++) {
+			if (prog_args.align != 0) {
+				struct buddy_entry_t *entry = buddy_alloc_aligned(&alloc, size,
+						prog_args.align);
+
+				if (entry != NULL) {
+					alloc_handles[count] = buddy_entry_handle(&alloc, entry);
+				}
+			} else {
+				alloc_handles[count] = buddy_alloc_handle(&alloc, size);
+			}
+			if (alloc_handles[count] == BUDDY_HANDLE_NONE) {
 				msg_err("allocation(%d) failed", count);
+			} else if (alloc.base != NULL) {
+				char *ptr = (char *)buddy_handle_ptr(&alloc, alloc_handles[count]);
+
+				ptr[0] = ptr[size - 1] = 0x5a;
 			}
 			count++;
 		}
 	}
-	buddy_print_statistics(&alloc);
+	buddy_driver_report(&alloc);
 	msg_info("made %d allocations", count);
+	if (prog_args.snapshot != NULL) {
+		if (buddy_snapshot_save(&alloc, prog_args.snapshot) != 0) {
+			msg_err("failed to write snapshot %s", prog_args.snapshot);
+		} else {
+			msg_info("snapshot written to %s", prog_args.snapshot);
+		}
+	}
 	for (int i = 0; i < count; i++) {
-		if (alloc_entries[i] != NULL) {
-			buddy_free(&alloc, alloc_entries[i]);
+		if (alloc_ranges != NULL) {
+			if (alloc_ranges[i].pages > 0) {
+				buddy_free_range(&alloc, &alloc_ranges[i]);
+			}
+			continue;
+		}
+		if (alloc_handles[i] == BUDDY_HANDLE_NONE) {
+			continue;
+		}
+		if (batch == NULL) {
+			buddy_free_handle(&alloc, alloc_handles[i]);
+			continue;
+		}
+		batch[nr_batch++] = buddy_handle_entry(&alloc, alloc_handles[i]);
+		if (nr_batch == prog_args.bulk) {
+			buddy_free_bulk(&alloc, batch, nr_batch);
+			nr_batch = 0;
 		}
 	}
-	buddy_print_statistics(&alloc);
-
+	if (nr_batch > 0) {
+		buddy_free_bulk(&alloc, batch, nr_batch);
+	}
+	buddy_thread_cache_drain(&alloc);
+	buddy_lf_drain(&alloc);
+	if (buddy_defers_merges(&alloc)) {
+		buddy_compact(&alloc);
+	}
+	buddy_driver_report(&alloc);
+	free(batch);
+	free(alloc_ranges);
+	free(alloc_handles);
+	buddy_allocator_destroy(&alloc);
 
 	return 0;
 }
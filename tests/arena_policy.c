@@ -0,0 +1,71 @@
+/*
+ * arena_policy.c: arena nodes honour the address-ordered policy.
+ *
+ * Every node of an arena built from an address policy template has to
+ * hand out its lowest free block first: fresh allocations climb from the
+ * node base and a freed hole is refilled before a later one.
+ */
+#define main buddy_main
+#include "../buddy_alloc.c"
+#undef main
+
+#define NR_NODES	2
+#define NR_BLOCKS	8
+
+int main(void)
+{
+	struct buddy_allocator_t template = {0};
+	struct buddy_arena_t arena = {0};
+	struct buddy_entry_t *entry[NR_BLOCKS];
+	int ret = 0;
+
+	template.max_order = 10;
+	template.page_size = 4096;
+	template.policy = BUDDY_POLICY_ADDRESS;
+	if (buddy_arena_init(&arena, &template, NR_NODES) != 0) {
+		msg_err("failed to initialize arena");
+		return 1;
+	}
+	for (int node = 0; node < NR_NODES && ret == 0; node++) {
+		uint64_t base = arena.start_addr + node * arena.node_size;
+		struct buddy_entry_t *refill;
+
+		if (arena.nodes[node].policy != BUDDY_POLICY_ADDRESS) {
+			msg_err("node %d runs policy %d", node, arena.nodes[node].policy);
+			ret = 1;
+			break;
+		}
+		for (int i = 0; i < NR_BLOCKS; i++) {
+			entry[i] = buddy_arena_alloc_node(&arena, node, 4096);
+			if (entry[i] == NULL || entry[i]->start_addr != base + i * 4096ULL) {
+				msg_err("node %d block %d not at 0x%" PRIx64, node, i,
+						base + i * 4096ULL);
+				ret = 1;
+				break;
+			}
+		}
+		if (ret != 0) {
+			break;
+		}
+		/* LIFO would hand back the hole freed last */
+		buddy_arena_free(&arena, entry[2]);
+		buddy_arena_free(&arena, entry[5]);
+		refill = buddy_arena_alloc_node(&arena, node, 4096);
+		if (refill == NULL || refill->start_addr != base + 2 * 4096ULL) {
+			msg_err("node %d refilled the higher hole first", node);
+			ret = 1;
+		}
+		entry[2] = refill;
+		for (int i = 0; i < NR_BLOCKS; i++) {
+			if (i != 5 && entry[i] != NULL) {
+				buddy_arena_free(&arena, entry[i]);
+			}
+		}
+	}
+	buddy_arena_destroy(&arena);
+	if (ret == 0) {
+		msg_info("arena_policy: ok");
+	}
+
+	return ret;
+}
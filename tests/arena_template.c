@@ -0,0 +1,83 @@
+/*
+ * arena_template.c: arena nodes carry every setting of their template.
+ *
+ * With handles set, list backend nodes keep a block map and serve handle
+ * calls. A template trace is shared by the nodes, which record distinct
+ * ids, and the trace is written out once. Backing memory is bound to
+ * the NUMA node of the same number wherever that node exists.
+ */
+#define main buddy_main
+#include "../buddy_alloc.c"
+#undef main
+
+#define NR_NODES	2
+#define TRACE		"arena_template.trace"
+
+int main(void)
+{
+	struct buddy_allocator_t template = {0};
+	struct buddy_arena_t arena = {0};
+	struct buddy_trace_header_t header;
+	struct buddy_entry_t *entry[NR_NODES];
+	FILE *file;
+	int ret = 0;
+
+	template.max_order = 10;
+	template.page_size = 4096;
+	template.handles = true;
+	template.memory = BUDDY_MEMORY_MMAP;
+	template.trace = buddy_trace_open(TRACE);
+	if (template.trace == NULL || buddy_arena_init(&arena, &template, NR_NODES) != 0) {
+		msg_err("failed to initialize arena");
+		return 1;
+	}
+	for (int node = 0; node < NR_NODES && ret == 0; node++) {
+		struct buddy_allocator_t *allocator = &arena.nodes[node];
+		unsigned long mask = 0;
+		char path[64];
+		int mode = -1;
+		buddy_handle_t handle;
+
+		handle = buddy_alloc_handle(allocator, 4096);
+		if (allocator->block_map == NULL || handle == BUDDY_HANDLE_NONE) {
+			msg_err("node %d serves no handles", node);
+			ret = 1;
+			break;
+		}
+		buddy_free_handle(allocator, handle);
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+		if (access(path, F_OK) == 0 && (syscall(__NR_get_mempolicy, &mode, &mask,
+				sizeof(mask) * 8 + 1, allocator->base, MPOL_F_ADDR) != 0 ||
+				mode != MPOL_BIND || mask != 1UL << node)) {
+			msg_err("node %d memory is not bound to NUMA node %d", node, node);
+			ret = 1;
+		}
+		entry[node] = buddy_arena_alloc_node(&arena, node, 4096);
+	}
+	if (ret == 0 && (entry[0] == NULL || entry[1] == NULL ||
+			buddy_trace_id(&arena.nodes[0], entry[0]->index) ==
+			buddy_trace_id(&arena.nodes[1], entry[1]->index))) {
+		msg_err("nodes record clashing trace ids");
+		ret = 1;
+	}
+	for (int node = 0; ret == 0 && node < NR_NODES; node++) {
+		buddy_arena_free(&arena, entry[node]);
+	}
+	buddy_arena_destroy(&arena);
+	file = fopen(TRACE, "rb");
+	if (ret == 0 && (file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+			header.nr_records != 4 * NR_NODES)) {
+		msg_err("trace holds %" PRIu64 " records, expected %d",
+				file != NULL ? header.nr_records : 0, 4 * NR_NODES);
+		ret = 1;
+	}
+	if (file != NULL) {
+		fclose(file);
+	}
+	unlink(TRACE);
+	if (ret == 0) {
+		msg_info("arena_template: ok");
+	}
+
+	return ret;
+}
@@ -0,0 +1,111 @@
+/*
+ * backend_stats.c: the list and bitmap backends report the same counts.
+ *
+ * Both allocators replay one trace of allocations, frees and resizes
+ * under the address policy, and after every step each order must show
+ * the same free and used block counts, split parents included in the
+ * used ones.
+ */
+#define main buddy_main
+#include "../buddy_alloc.c"
+#undef main
+
+#define MAX_ORDER	12
+#define NR_SLOTS	64
+#define NR_STEPS	4000
+
+static int buddy_init_backend(struct buddy_allocator_t *allocator, enum buddy_backend_t backend)
+{
+	memset(allocator, 0, sizeof(*allocator));
+	allocator->max_order = MAX_ORDER;
+	allocator->page_size = 4096;
+	allocator->backend = backend;
+	/* lowest block first, so both backends end up with the same layout */
+	allocator->policy = BUDDY_POLICY_ADDRESS;
+
+	return buddy_allocator_init(allocator);
+}
+
+static int buddy_stats_differ(struct buddy_allocator_t *list, struct buddy_allocator_t *bitmap,
+		int step)
+{
+	struct buddy_stats_t a, b;
+
+	buddy_get_stats(list, &a);
+	buddy_get_stats(bitmap, &b);
+	for (int i = 0; i <= MAX_ORDER; i++) {
+		if (a.order[i].free_blocks != b.order[i].free_blocks ||
+				a.order[i].used_blocks != b.order[i].used_blocks) {
+			msg_err("step %d order %d: list %d free %d used, bitmap %d free %d used",
+					step, i, a.order[i].free_blocks, a.order[i].used_blocks,
+					b.order[i].free_blocks, b.order[i].used_blocks);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	struct buddy_allocator_t list, bitmap;
+	struct buddy_entry_t *slots[2][NR_SLOTS] = {{0}};
+	uint32_t seed = 12345;
+	int ret = 0;
+
+	if (buddy_init_backend(&list, BUDDY_BACKEND_LIST) != 0 ||
+			buddy_init_backend(&bitmap, BUDDY_BACKEND_BITMAP) != 0) {
+		msg_err("failed to initialize allocators");
+		return 1;
+	}
+	for (int step = 0; step < NR_STEPS && ret == 0; step++) {
+		struct buddy_allocator_t *allocators[2] = { &list, &bitmap };
+		int slot, action;
+		uint64_t size;
+
+		seed = seed * 1103515245 + 12345;
+		slot = (seed >> 8) % NR_SLOTS;
+		action = (seed >> 16) % 4;
+		size = 4096ULL << ((seed >> 20) % 6);
+		for (int k = 0; k < 2; k++) {
+			struct buddy_entry_t **entry = &slots[k][slot];
+
+			if (*entry == NULL) {
+				*entry = buddy_alloc(allocators[k], size);
+			} else if (action == 0) {
+				struct buddy_entry_t *resized = buddy_realloc(allocators[k], *entry, size);
+
+				if (resized != NULL) {
+					*entry = resized;
+				}
+			} else {
+				buddy_free(allocators[k], *entry);
+				*entry = NULL;
+			}
+		}
+		if ((slots[0][slot] == NULL) != (slots[1][slot] == NULL)) {
+			msg_err("step %d: only one backend served slot %d", step, slot);
+			ret = 1;
+			break;
+		}
+		ret = buddy_stats_differ(&list, &bitmap, step);
+	}
+	for (int slot = 0; slot < NR_SLOTS; slot++) {
+		if (slots[0][slot] != NULL) {
+			buddy_free(&list, slots[0][slot]);
+		}
+		if (slots[1][slot] != NULL) {
+			buddy_free(&bitmap, slots[1][slot]);
+		}
+	}
+	if (ret == 0) {
+		ret = buddy_stats_differ(&list, &bitmap, NR_STEPS);
+	}
+	buddy_allocator_destroy(&list);
+	buddy_allocator_destroy(&bitmap);
+	if (ret == 0) {
+		msg_info("backend_stats: ok");
+	}
+
+	return ret;
+}
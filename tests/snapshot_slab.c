@@ -0,0 +1,98 @@
+/*
+ * snapshot_slab.c: slabs do not survive a snapshot as orphaned blocks.
+ *
+ * A snapshot holds block placement only, so the slabs behind live slab
+ * objects have to come back free after a restore, while plain allocated
+ * blocks come back allocated. Freeing those must leave the region whole.
+ */
+#define main buddy_main
+#include "../buddy_alloc.c"
+#undef main
+
+#define MAX_ORDER	10
+#define NR_OBJECTS	64
+#define NR_BLOCKS	4
+#define SNAPSHOT	"snapshot_slab.snap"
+
+static void buddy_init_mmap(struct buddy_allocator_t *allocator, enum buddy_backend_t backend)
+{
+	memset(allocator, 0, sizeof(*allocator));
+	allocator->max_order = MAX_ORDER;
+	allocator->page_size = 4096;
+	allocator->backend = backend;
+	allocator->memory = BUDDY_MEMORY_MMAP;
+	allocator->handles = true;
+}
+
+static int buddy_check_backend(enum buddy_backend_t backend)
+{
+	struct buddy_allocator_t saved, restored;
+	struct buddy_entry_t *block[NR_BLOCKS];
+	struct buddy_frag_t frag;
+	int used = 0;
+
+	buddy_init_mmap(&saved, backend);
+	if (buddy_allocator_init(&saved) != 0) {
+		msg_err("failed to initialize allocator");
+		return 1;
+	}
+	for (int i = 0; i < NR_OBJECTS; i++) {
+		if (buddy_slab_alloc(&saved, 64 << (i % 4)) == NULL) {
+			msg_err("slab allocation %d failed", i);
+			buddy_allocator_destroy(&saved);
+			return 1;
+		}
+	}
+	for (int i = 0; i < NR_BLOCKS; i++) {
+		block[i] = buddy_alloc(&saved, 4096ULL << i);
+	}
+	if (buddy_snapshot_save(&saved, SNAPSHOT) != 0) {
+		msg_err("failed to save snapshot");
+		buddy_allocator_destroy(&saved);
+		return 1;
+	}
+	buddy_init_mmap(&restored, backend);
+	if (buddy_snapshot_restore(&restored, SNAPSHOT) != 0) {
+		msg_err("failed to restore snapshot");
+		buddy_allocator_destroy(&saved);
+		unlink(SNAPSHOT);
+		return 1;
+	}
+	unlink(SNAPSHOT);
+	for (int i = 0; i < NR_BLOCKS; i++) {
+		buddy_handle_t handle = buddy_entry_handle(&saved, block[i]);
+		struct buddy_entry_t *entry = buddy_handle_entry(&restored, handle);
+
+		if (entry == NULL) {
+			msg_err("block %d did not come back", i);
+			used = -1;
+			break;
+		}
+		buddy_free(&restored, entry);
+	}
+	for (int i = 0; used == 0 && i <= MAX_ORDER; i++) {
+		used += restored.buddy_list[i].used_count;
+	}
+	buddy_get_frag(&restored, &frag);
+	buddy_allocator_destroy(&saved);
+	buddy_allocator_destroy(&restored);
+	if (used != 0 || frag.largest_order != MAX_ORDER) {
+		msg_err("%s backend: %d blocks left over, largest free order %d",
+				backend == BUDDY_BACKEND_BITMAP ? "bitmap" : "list", used,
+				frag.largest_order);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	if (buddy_check_backend(BUDDY_BACKEND_LIST) != 0 ||
+			buddy_check_backend(BUDDY_BACKEND_BITMAP) != 0) {
+		return 1;
+	}
+	msg_info("snapshot_slab: ok");
+
+	return 0;
+}